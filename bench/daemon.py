@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Direct walks against queries answered by the daemon
+
+Starts ff --daemon on a directory, waits for the crawl to finish and
+then times the same searches once as a direct walk and once through
+--connect.  Both are warm, the best of the runs is reported together
+with the number of results, which has to be the same for both.
+
+Usage: bench/daemon.py [directory [runs]]
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+from timing import FF, best_of
+
+QUERIES = (
+    ("zlib", ["zlib"]),
+    ("zlib -u", ["-u", "zlib"]),
+    ("everything", [""]),
+    ("everything -u", ["-u", ""]),
+)
+
+
+def results(cmd):
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True).stdout
+    return out.count(b"\n")
+
+
+def main():
+    path = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "/usr")
+    runs = int(sys.argv[2]) if len(sys.argv) > 2 else 9
+
+    with tempfile.TemporaryDirectory() as tmp:
+        sock = os.path.join(tmp, "ff.sock")
+        start = time.perf_counter()
+        daemon = subprocess.Popen([FF, "--daemon", sock, path],
+                                  stdout=subprocess.DEVNULL)
+        try:
+            # The socket is only bound once the crawl is done
+            while not os.path.exists(sock):
+                if daemon.poll() is not None:
+                    sys.exit("ff --daemon exited")
+                time.sleep(0.01)
+            results([FF, "--connect", sock, ""])
+            print(f"crawl of {path}: "
+                  f"{(time.perf_counter() - start) * 1e3:.0f} ms")
+
+            print(f"best of {runs}")
+            print(f"{'':16s} {'direct':>10s} {'--connect':>10s} "
+                  f"{'results':>9s}")
+            for name, args in QUERIES:
+                direct = [FF] + args + [path]
+                connect = [FF, "--connect", sock] + args
+                n, m = results(direct), results(connect)
+                print(f"{name:16s} {best_of(runs, direct):7.1f} ms "
+                      f"{best_of(runs, connect):7.1f} ms "
+                      f"{n:9d}" + ("" if n == m else f" != {m}"))
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Matching against a long .gitignore
+
+Copies a directory, /usr/include by default, into a fresh repository
+whose .gitignore has 351 rules: 150 names, 150 "*.ext" patterns, 30
+prefix globs, 20 anchored directories and one negation.  None of them
+matches much, so the time goes into trying them.  Reports the best
+walk with the rules and with -I.  If BASE names another ff, it is
+timed the same way for comparison.
+
+Usage: bench/gitignore.py [directory [runs]]
+"""
+
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+from timing import FF, best_of
+
+
+def rules():
+    yield from (f"name{i}" for i in range(150))
+    yield from (f"*.ext{i}" for i in range(150))
+    yield from (f"pre{i}*" for i in range(30))
+    yield from (f"/dir{i}/" for i in range(20))
+    yield "!name0"
+
+
+def populate(source, path):
+    if not os.path.isdir(path):
+        shutil.copytree(source, path, symlinks=True)
+        subprocess.run(["git", "init", "-q", path], check=True)
+    with open(os.path.join(path, ".gitignore"), "w") as f:
+        f.write("\n".join(rules()) + "\n")
+
+
+def main():
+    source = sys.argv[1] if len(sys.argv) > 1 else "/usr/include"
+    runs = int(sys.argv[2]) if len(sys.argv) > 2 else 9
+    path = os.path.join(tempfile.gettempdir(), "ff-bench-gitignore")
+    populate(source, path)
+
+    builds = [("ff", FF)]
+    if "BASE" in os.environ:
+        builds.append(("base", os.path.abspath(os.environ["BASE"])))
+    print(f"copy of {source} in {path}, best of {runs}")
+    print(f"{'':8s} {'351 rules':>10s} {'-I':>10s}")
+    for name, ff in builds:
+        with_rules = best_of(runs, [ff, "", path])
+        without = best_of(runs, [ff, "-I", "", path])
+        print(f"{name:8s} {with_rules:7.1f} ms {without:7.1f} ms")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,86 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "glob.h"
+
+// C standard library
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <fnmatch.h>
+
+// Differential check of the compiled globs against fnmatch
+//
+// Matches a list of fixed cases and then random patterns, built from
+// the pieces of bracket expressions, against random names, with and
+// without ignoring the case.  Prints the first differences from glibc
+// fnmatch and fails if there were any.
+//
+// Usage: bench/glob [patterns [seed]]
+
+static const char *const cases[][2] = {
+    {"[[.a.]]", "a"},       {"[[=a=]]", "a"},     {"b[a[.]", "b."},
+    {"[?-", "[]-"},         {"[[.-.]]", "-"},     {"[[.a.]-c]", "b"},
+    {"[[.ab.]]", "a"},      {"[[=a]", "=]"},      {"[[", "[["},
+    {"[[a", "[[a"},         {"[.-\\[.a.]", ":"},  {"[]a]*", "]x"},
+    {"[!]a]", "b"},         {"[a-]*", "-"},       {"[\\]]", "]"},
+    {"[[:alpha:]", "a"},    {"*[[:foo:]]", "f"},  {"[z-a]", "z"},
+    {"[[:alpha:]]*", "Ab"}, {"[a\\", "a"},        {"lib*.[0-9]", "libz.1"},
+};
+
+static const char *const pieces[] = {
+    "[",     "]",     "[:alpha:]", "[:upper:]", "[:",   "[::]", ":]",
+    "[.",    ".]",    "[=",        "=]",        ".",    "=",    ":",
+    "a",     "b",     "z",         "A",         "-",    "!",    "^",
+    "\\",    "*",     "?",         "[:abcdefgh", "[:foo:]", "[.ab.]",
+    "[.a.]", "[=a=]", "[",
+};
+
+static const size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+
+static const char names[] = "abzA.-]![\\:=";
+
+static long check(const char *pattern, const char *name) {
+    long differences = 0;
+    size_t len = strlen(name);
+    for (int icase = 0; icase < 2; ++icase) {
+        glob *g = glob_compile(&pattern, 1, icase);
+        bool ours = glob_match(g, name, len, len);
+        bool theirs = fnmatch(pattern, name, icase ? FNM_CASEFOLD : 0) == 0;
+        glob_free(g);
+        if (ours != theirs) {
+            printf("%s'%s' '%s': glob %d, fnmatch %d\n", icase ? "-i " : "",
+                   pattern, name, ours, theirs);
+            ++differences;
+        }
+    }
+    return differences;
+}
+
+int main(int argc, char *argv[]) {
+    long n = argc > 1 ? strtol(argv[1], NULL, 0) : 1000000;
+    srand(argc > 2 ? (unsigned)strtoul(argv[2], NULL, 0) : 1);
+
+    long differences = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        differences += check(cases[i][0], cases[i][1]);
+    }
+    for (long i = 0; i < n && differences < 25; ++i) {
+        char pattern[64] = "";
+        for (int j = 1 + rand() % 6; j > 0; --j) {
+            strcat(pattern, pieces[(size_t)rand() % npieces]);
+        }
+        char name[8];
+        int len = rand() % 5;
+        for (int j = 0; j < len; ++j) {
+            name[j] = names[rand() % (sizeof(names) - 1)];
+        }
+        name[len] = '\0';
+        differences += check(pattern, name);
+    }
+    printf("%ld differences\n", differences);
+    return differences > 0;
+}
@@ -0,0 +1,185 @@
+#include "message.h"
+
+// C standard library
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// POSIX C library
+#include <pthread.h>
+#include <time.h>
+
+// Shared queue microbenchmark
+//
+// A single thread puts n messages with random priorities from 1 to 32
+// into the shared queue and then drains it again, once with the sorted
+// list the queue used to be and once with the heap it is now.  The heap
+// is drained with deque_get, which is what the workers fall back to
+// once their own deques are empty.  The list walks half of itself on
+// every put, so it is only run up to LIST_MAX messages.
+//
+// Usage: bench/queue [n...]
+
+#define LIST_MAX 100000
+
+static double elapsed_ms(const struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (double)(end.tv_sec - start->tv_sec) * 1e3
+           + (double)(end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void nothing(void *ptr) { (void)ptr; }
+
+// The shared priority list from before the heap, with the insertion of
+// the old queue_put and the removal of the old queue_pop
+typedef struct _node node;
+struct _node {
+    size_t priority;
+    message *msg;
+    node *next;
+};
+
+typedef struct {
+    node *head;
+    node *tail;
+    size_t length;
+    pthread_mutex_t lock;
+} list;
+
+static void list_put(list *q, message *msg, size_t priority) {
+    node *new_node = (node *)malloc(sizeof(node));
+    new_node->priority = priority;
+    new_node->msg = msg;
+    new_node->next = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head == NULL || q->tail == NULL) {
+        q->head = new_node;
+        q->tail = new_node;
+    } else {
+        // Walk the list until an item with lower priority is found or
+        // the list has ended
+        node *p = q->head;
+        while (p != q->tail && p->priority > priority) {
+            if (p->next == NULL) {
+                break;
+            }
+            p = p->next;
+        }
+
+        node *next = p->next;
+        p->next = new_node;
+        new_node->next = next;
+        if (next == NULL) {
+            q->tail = new_node;
+        }
+    }
+    __atomic_add_fetch(&q->length, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static message *list_pop(list *q) {
+    message *msg = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != NULL) {
+        msg = q->head->msg;
+        node *oldhead = q->head;
+        if (q->head->next) {
+            q->head = q->head->next;
+        } else {
+            q->head = NULL;
+            q->tail = NULL;
+        }
+        free(oldhead);
+        __atomic_sub_fetch(&q->length, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return msg;
+}
+
+static void run_list(message **msgs, const size_t *prios, size_t n,
+                     double *put, double *get) {
+    list q = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; ++i) {
+        list_put(&q, msgs[i], prios[i]);
+    }
+    *put = elapsed_ms(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; ++i) {
+        list_pop(&q);
+    }
+    *get = elapsed_ms(&start);
+}
+
+static void run_heap(message **msgs, const size_t *prios, size_t n,
+                     double *put, double *get) {
+    queue *q = queue_new(1);
+    deque *d = queue_attach(q);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; ++i) {
+        queue_put(q, msgs[i], prios[i]);
+    }
+    *put = elapsed_ms(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < n; ++i) {
+        deque_get(d);
+    }
+    *get = elapsed_ms(&start);
+
+    queue_close(q);
+    queue_free(q);
+}
+
+static void run(size_t n) {
+    message **msgs = (message **)malloc(n * sizeof(message *));
+    size_t *prios = (size_t *)malloc(n * sizeof(size_t));
+    for (size_t i = 0; i < n; ++i) {
+        msgs[i] = message_new((void *)(uintptr_t)i, nothing);
+        prios[i] = 1 + (size_t)(rand() % 32);
+    }
+
+    double list_put, list_get, heap_put, heap_get;
+    run_heap(msgs, prios, n, &heap_put, &heap_get);
+    if (n <= LIST_MAX) {
+        run_list(msgs, prios, n, &list_put, &list_get);
+        printf("%10zu %12.2f ms %12.2f ms %12.2f ms %12.2f ms\n", n,
+               list_put, list_get, heap_put, heap_get);
+    } else {
+        printf("%10zu %15s %15s %12.2f ms %12.2f ms\n", n, "-", "-",
+               heap_put, heap_get);
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        message_free(msgs[i]);
+    }
+    free(prios);
+    free(msgs);
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t sizes[] = {1000, 10000, 50000, 100000, 1000000};
+
+    message_init_global();
+    srand(1);
+    printf("%10s %15s %15s %15s %15s\n", "n", "list put", "list get",
+           "heap put", "heap get");
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            run((size_t)strtoul(argv[i], NULL, 0));
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+            run(sizes[i]);
+        }
+    }
+    message_free_global();
+    return 0;
+}
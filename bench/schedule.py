@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+"""Time to the first result for each --schedule
+
+Runs a few searches with --schedule deep, shallow and hybrid, the
+policies interleaved round by round, and reports the median time to
+the first result and in total.  stdout is a pty, so the output is
+flushed per directory as an interactive picker would see it.  The
+arguments of a single search may be given instead of the built-in
+ones.
+
+Usage: bench/schedule.py [rounds [ff arguments...]]
+"""
+
+import shlex
+import statistics
+import sys
+
+from timing import FF, first_and_total
+
+POLICIES = ("deep", "shallow", "hybrid")
+
+QUERIES = (
+    ["", "/usr"],
+    ["^README", "/usr"],
+    ["\\.conf$", "/"],
+    ["stdio", "/usr/include"],
+)
+
+
+def main():
+    rounds = int(sys.argv[1]) if len(sys.argv) > 1 else 15
+    queries = [sys.argv[2:]] if len(sys.argv) > 2 else QUERIES
+
+    print(f"median of {rounds} rounds")
+    print(f"{'':28s} {'':8s} {'first':>10s} {'total':>10s}")
+    for args in queries:
+        times = {p: ([], []) for p in POLICIES}
+        for _ in range(rounds):
+            for p in POLICIES:
+                first, total = first_and_total(
+                    [FF, "--schedule", p] + args, tty=True)
+                times[p][0].append(first)
+                times[p][1].append(total)
+        for p in POLICIES:
+            print(f"{shlex.join(args):28s} {p:8s} "
+                  f"{statistics.median(times[p][0]):7.1f} ms "
+                  f"{statistics.median(times[p][1]):7.1f} ms")
+
+
+if __name__ == "__main__":
+    main()
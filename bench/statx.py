@@ -0,0 +1,63 @@
+#!/usr/bin/env python3
+"""Metadata lookups of -S with and without io_uring
+
+Times ff -S +10k on /usr with -I -H and on 20 directories of 2000
+empty files each.  Warm runs are the best of 9, cold runs the best of
+5 after dropping the page cache, which needs root and is skipped
+otherwise.  If URING names an ff built with make uring, it is timed
+the same way.
+
+Usage: bench/statx.py
+"""
+
+import os
+import sys
+import tempfile
+
+from timing import FF, best_of, drop_caches
+
+
+def populate(path, dirs, files):
+    for d in range(dirs):
+        sub = os.path.join(path, str(d))
+        os.makedirs(sub, exist_ok=True)
+        if len(os.listdir(sub)) == files:
+            continue
+        for i in range(files):
+            open(os.path.join(sub, str(i)), "w").close()
+
+
+def best_cold(n, cmd):
+    best = float("inf")
+    for _ in range(n):
+        drop_caches()
+        best = min(best, best_of(1, cmd))
+    return best
+
+
+def main():
+    flat = os.path.join(tempfile.gettempdir(), "ff-bench-statx")
+    populate(flat, 20, 2000)
+    trees = (("/usr -I -H", ["-I", "-H", "/usr"]),
+             ("20 dirs x 2000 files", [flat]))
+
+    builds = [("sync", FF)]
+    if "URING" in os.environ:
+        builds.append(("io_uring", os.path.abspath(os.environ["URING"])))
+    cold = os.geteuid() == 0
+    if not cold:
+        print("not root, skipping the cold runs", file=sys.stderr)
+
+    print(f"{'':22s} {'':10s} {'warm':>10s} {'cold':>10s}")
+    for tree, args in trees:
+        for name, ff in builds:
+            cmd = [ff, "-S", "+10k", ""] + args
+            warm = best_of(9, cmd)
+            line = f"{tree:22s} {name:10s} {warm:7.1f} ms"
+            if cold:
+                line += f" {best_cold(5, cmd):7.1f} ms"
+            print(line)
+
+
+if __name__ == "__main__":
+    main()
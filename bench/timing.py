@@ -0,0 +1,53 @@
+"""Timing helpers shared by the benchmark scripts"""
+
+import os
+import pty
+import subprocess
+import time
+
+# The ff under test, relative paths are taken from the repository
+FF = os.path.abspath(os.environ.get("FF", "./ff"))
+
+
+def best_of(n, cmd, cwd=None):
+    """Best wall time of n runs in ms, with the output discarded"""
+    best = float("inf")
+    for _ in range(n):
+        start = time.perf_counter()
+        subprocess.run(cmd, cwd=cwd, stdout=subprocess.DEVNULL, check=False)
+        best = min(best, time.perf_counter() - start)
+    return best * 1e3
+
+
+def first_and_total(cmd, cwd=None, tty=False):
+    """Time to the first output and to the end in ms.  On a tty the
+    output is flushed as an interactive user would see it."""
+    if tty:
+        reader, writer = pty.openpty()
+    else:
+        reader, writer = os.pipe()
+    start = time.perf_counter()
+    proc = subprocess.Popen(cmd, cwd=cwd, stdout=writer,
+                            stderr=subprocess.DEVNULL)
+    os.close(writer)
+    first = None
+    while True:
+        try:
+            data = os.read(reader, 1 << 16)
+        except OSError:
+            break
+        if not data:
+            break
+        if first is None:
+            first = time.perf_counter()
+    proc.wait()
+    end = time.perf_counter()
+    os.close(reader)
+    return ((first or end) - start) * 1e3, (end - start) * 1e3
+
+
+def drop_caches():
+    """Empty the page cache, which needs root"""
+    subprocess.run(["sync"], check=True)
+    with open("/proc/sys/vm/drop_caches", "w") as f:
+        f.write("3\n")
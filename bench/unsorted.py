@@ -0,0 +1,43 @@
+#!/usr/bin/env python3
+"""Sorted against --unsorted output on a flat directory
+
+Lists a directory of empty files with a single thread, once sorted and
+once with --unsorted, and reports the best total time with the output
+discarded and the best time to the first result.
+
+Usage: bench/unsorted.py [directory [files [runs]]]
+"""
+
+import os
+import sys
+import tempfile
+
+from timing import FF, best_of, first_and_total
+
+
+def populate(path, files):
+    os.makedirs(path, exist_ok=True)
+    if len(os.listdir(path)) == files:
+        return
+    for i in range(files):
+        open(os.path.join(path, str(i)), "w").close()
+
+
+def main():
+    path = (sys.argv[1] if len(sys.argv) > 1
+            else os.path.join(tempfile.gettempdir(), "ff-bench-flat"))
+    files = int(sys.argv[2]) if len(sys.argv) > 2 else 300000
+    runs = int(sys.argv[3]) if len(sys.argv) > 3 else 5
+    populate(path, files)
+
+    print(f"{files} files in {path}, -j1, best of {runs}")
+    print(f"{'':20s} {'total':>10s} {'first result':>14s}")
+    for name, flags in (("sorted (default)", []), ("--unsorted", ["-u"])):
+        cmd = [FF, "-j1"] + flags
+        total = best_of(runs, cmd, cwd=path)
+        first = min(first_and_total(cmd, cwd=path)[0] for _ in range(runs))
+        print(f"{name:20s} {total:7.1f} ms {first:11.1f} ms")
+
+
+if __name__ == "__main__":
+    main()
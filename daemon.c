@@ -0,0 +1,1242 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "daemon.h"
+
+#include "arena.h"
+#include "dirstream.h"
+#include "filetree.h"
+#include "gitignore.h"
+#include "glob.h"
+#include "limiter.h"
+#include "match.h"
+#include "outbuf.h"
+#include "regex.h"
+
+// C standard library
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// POSIX C library
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Resident daemon
+//
+// After the initial crawl the daemon keeps every entry in memory and
+// follows the changes through inotify.  Queries arrive on a unix socket
+// as a fixed header followed by the NUL-terminated patterns and the
+// extension.  The answer starts with a status byte.  If the daemon
+// can answer, the matching entries follow, each as its type, the
+// number of the pattern it matched if asked for, and the
+// NUL-terminated path.  Otherwise the NUL-terminated roots follow, so
+// the client can search them itself, or the message about a pattern
+// the daemon could not compile.  Everything happens on a single
+// thread, so a query always sees a consistent tree.
+//
+// The roots are watched by their full paths, so the client can show
+// the paths of the answer relative to its own working directory.
+
+typedef struct {
+    uint32_t mode;
+    uint32_t icase;
+    uint32_t only_type;
+    uint32_t tag;
+    // traversal options of the client
+    int32_t max_depth;
+    uint32_t skip_hidden;
+    uint32_t no_ignore;
+    uint32_t npatterns;
+    uint32_t l_patterns;
+    uint32_t l_ext;
+} query_header;
+
+#define QUERY_MAX_STRING 4096
+#define QUERY_MAX_LENGTH (sizeof(query_header) + 2 * QUERY_MAX_STRING)
+
+#define ANSWER_OK 'y'
+#define ANSWER_REFUSED 'n'
+#define ANSWER_ERROR 'e'
+
+// Answers are written out in batches of this size, which the buffer of
+// an answer grows by at first
+#define ANSWER_BATCH_SIZE (64 * 1024)
+
+// Clients which neither send nor receive are dropped after this time
+#define CLIENT_TIMEOUT 5
+
+// Writes are only of interest for the ignore files, the self events
+// only for the roots
+#define INOTIFY_MASK                                                      \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+     | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW         \
+     | IN_EXCL_UNLINK)
+
+// $GIT_DIR/info is watched for its exclude file only.  It may be in the
+// tree as well, in which case both share one watch.
+#define EXCLUDE_MASK                                                      \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE \
+     | IN_ONLYDIR | IN_MASK_ADD)
+
+// The ignore rules of a directory which has a .gitignore of its own or
+// is the root of a repository.  Its subdirectories refer to the same
+// record, which is freed together with the directory.
+typedef struct {
+    gitignore *frame;
+    filetree_dir *dir;
+    // watch on $GIT_DIR/info of a repository, or -1
+    int exclude;
+} dir_rules;
+
+// A client with its query as far as it has arrived, then its answer as
+// far as it has not been sent yet.  The sockets are non-blocking, so a
+// slow client holds up neither the others nor the updates.
+typedef struct {
+    int fd;
+    char *in;
+    size_t l_in;
+    char *out;
+    size_t l_out;
+    size_t s_out;
+    size_t off_out;
+    bool answered;
+    // when the client last sent or received anything
+    time_t last;
+} client;
+
+typedef struct {
+    const options *opt;
+    filetree *tree;
+    int inotify;
+    dirstream *ds;
+    const char **roots;
+    size_t nroots;
+    // repositories whose $GIT_DIR/info is watched
+    dir_rules **repos;
+    size_t nrepos;
+    size_t arepos;
+    bool out_of_watches;
+    client *clients;
+    size_t nclients;
+    size_t aclients;
+} daemon_state;
+
+// Marks directories known not to be in a repository
+static char no_repo;
+
+// Marks directories which changed during the crawl
+static char stale;
+
+static volatile sig_atomic_t stopped = 0;
+
+static void stop(int sig) {
+    (void)sig;
+    stopped = 1;
+}
+
+// Seconds on the monotonic clock
+static time_t now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static bool socket_address(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "%s: Socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool write_all(int fd, const void *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, (const char *)buf + off, len - off);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        off += (size_t)n;
+    }
+    return true;
+}
+
+// Length of the root the path belongs to, or 0
+static size_t root_length(daemon_state *st, const char *path, size_t len) {
+    for (size_t i = 0; i < st->nroots; ++i) {
+        size_t l_root = strlen(st->roots[i]);
+        if (len >= l_root && memcmp(path, st->roots[i], l_root) == 0
+            && (len == l_root || path[l_root] == '/')) {
+            return l_root;
+        }
+    }
+    return 0;
+}
+
+// Depth of the path below the root it belongs to, or -1
+static int depth_of(daemon_state *st, const char *path, size_t len) {
+    size_t l_root = root_length(st, path, len);
+    if (l_root == 0) {
+        return -1;
+    }
+    int depth = 0;
+    for (size_t j = l_root; j < len; ++j) {
+        depth += path[j] == '/';
+    }
+    return depth;
+}
+
+// Watch $GIT_DIR/info of the repository for changes of the exclude file
+static void watch_exclude(daemon_state *st, dir_rules *r, const char *path,
+                          size_t len) {
+    char *info = (char *)malloc((len + sizeof("/.git/info")) * sizeof(char));
+    memcpy(info, path, len);
+    memcpy(info + len, "/.git/info", sizeof("/.git/info"));
+    r->exclude = inotify_add_watch(st->inotify, info, EXCLUDE_MASK);
+    free(info);
+    if (r->exclude < 0) {
+        return;
+    }
+    if (st->nrepos == st->arepos) {
+        st->arepos = st->arepos ? 2 * st->arepos : 16;
+        st->repos = (dir_rules **)realloc(st->repos,
+                                          st->arepos * sizeof(dir_rules *));
+    }
+    st->repos[st->nrepos++] = r;
+}
+
+// The repository whose $GIT_DIR/info has the watch, if any
+static dir_rules *exclude_of(daemon_state *st, int watch) {
+    for (size_t i = 0; i < st->nrepos; ++i) {
+        if (st->repos[i]->exclude == watch) {
+            return st->repos[i];
+        }
+    }
+    return NULL;
+}
+
+// The ignore rules which apply to the entries of the directory, i.e.
+// those of the repository it or the closest parent is the root of,
+// with the frames of all .gitignore in between.  The answer is
+// remembered in the directory.
+static dir_rules *rules_of(daemon_state *st, filetree_dir *d) {
+    void **data = filetree_dir_data(d);
+    if (*data == NULL) {
+        size_t len;
+        const char *path = filetree_dir_path(d, &len);
+        gitignore *g = gitignore_new(path);
+        bool repo = g != NULL;
+        dir_rules *parent_rules = NULL;
+        if (g == NULL && depth_of(st, path, len) > 0) {
+            size_t slash = len;
+            while (slash > 0 && path[slash - 1] != '/') {
+                --slash;
+            }
+            filetree_dir *parent =
+                slash > 1 ? filetree_find(st->tree, path, slash - 1) : NULL;
+            parent_rules = parent != NULL ? rules_of(st, parent) : NULL;
+            g = parent_rules != NULL
+                    ? gitignore_push(parent_rules->frame, path, len)
+                    : NULL;
+        }
+        if (g != NULL) {
+            dir_rules *r = (dir_rules *)malloc(sizeof(dir_rules));
+            r->frame = g;
+            r->dir = d;
+            r->exclude = -1;
+            if (repo) {
+                watch_exclude(st, r, path, len);
+            }
+            *data = r;
+        } else {
+            *data = parent_rules != NULL ? (void *)parent_rules
+                                         : (void *)&no_repo;
+        }
+    }
+    return *data == &no_repo ? NULL : (dir_rules *)*data;
+}
+
+static gitignore *repo_of(daemon_state *st, filetree_dir *d) {
+    if (st->opt->no_ignore) {
+        return NULL;
+    }
+    dir_rules *r = rules_of(st, d);
+    return r != NULL ? r->frame : NULL;
+}
+
+static void add_watch(daemon_state *st, filetree_dir *d) {
+    size_t len;
+    const char *path = filetree_dir_path(d, &len);
+    int wd = inotify_add_watch(st->inotify, path, INOTIFY_MASK);
+    if (wd >= 0) {
+        filetree_set_watch(st->tree, d, wd);
+    } else if (errno == ENOSPC && !st->out_of_watches) {
+        fputs("ff: Out of inotify watches, changes will be missed.  Raise "
+              "fs.inotify.max_user_watches\n",
+              stderr);
+        st->out_of_watches = true;
+    }
+}
+
+// Drop the watch of a directory leaving the tree, and its ignore rules
+// if they are its own
+static void forget(void *ctx, filetree_dir *d) {
+    daemon_state *st = (daemon_state *)ctx;
+    if (filetree_dir_watch(d) >= 0) {
+        inotify_rm_watch(st->inotify, filetree_dir_watch(d));
+    }
+
+    void **data = filetree_dir_data(d);
+    if (*data == NULL || *data == &no_repo || *data == &stale
+        || ((dir_rules *)*data)->dir != d) {
+        return;
+    }
+    dir_rules *r = (dir_rules *)*data;
+    if (r->exclude >= 0) {
+        inotify_rm_watch(st->inotify, r->exclude);
+        for (size_t i = 0; i < st->nrepos; ++i) {
+            if (st->repos[i] == r) {
+                st->repos[i] = st->repos[--st->nrepos];
+                break;
+            }
+        }
+    }
+    gitignore_free(r->frame);
+    free(r);
+    *data = NULL;
+}
+
+// Forget everything, e.g. before starting over
+static void forget_all(daemon_state *st) {
+    for (size_t i = 0; i < st->nroots; ++i) {
+        filetree_remove(st->tree, st->roots[i], strlen(st->roots[i]), forget,
+                        st);
+    }
+}
+
+// Read a directory which appeared after the crawl, and everything
+// below it.  The watch is set up before reading, so nothing created in
+// between is missed.
+static void scan_dir(daemon_state *st, const char *path, size_t len,
+                     int depth) {
+    if (st->opt->max_depth > 0 && depth >= st->opt->max_depth) {
+        return;
+    }
+
+    filetree_dir *d = filetree_add_dir(st->tree, path, len);
+    add_watch(st, d);
+    gitignore *repo = repo_of(st, d);
+
+    if (!dirstream_open(st->ds, AT_FDCWD, path)) {
+        return;
+    }
+
+    char *current = (char *)malloc((len + NAME_MAX + 2) * sizeof(char));
+    memcpy(current, path, len);
+    current[len] = '/';
+
+    // The subdirectories are only read once we are done with this one,
+    // so the directory stream can be reused
+    size_t l_subdirs = 0, s_subdirs = 256;
+    char *subdirs = (char *)malloc(s_subdirs * sizeof(char));
+
+    dirstream_entry entry;
+    while (dirstream_read(st->ds, &entry)) {
+        if (entry.name[0] == '.'
+            && (entry.namlen == 1
+                || (entry.namlen == 2 && entry.name[1] == '.'))) {
+            continue;
+        }
+        if (st->opt->skip_hidden && entry.name[0] == '.') {
+            continue;
+        }
+
+        size_t l_current = len + 1 + entry.namlen;
+        memcpy(current + len + 1, entry.name, entry.namlen);
+        current[l_current] = '\0';
+        if (repo != NULL
+            && gitignore_is_ignored(repo, current, l_current, entry.type)) {
+            continue;
+        }
+
+        filetree_add(st->tree, current, l_current, entry.type, false);
+        if (entry.type == DT_DIR) {
+            if (l_subdirs + entry.namlen + 1 > s_subdirs) {
+                while (l_subdirs + entry.namlen + 1 > s_subdirs) {
+                    s_subdirs *= 2;
+                }
+                subdirs = (char *)realloc(subdirs, s_subdirs * sizeof(char));
+            }
+            memcpy(subdirs + l_subdirs, entry.name, entry.namlen + 1);
+            l_subdirs += entry.namlen + 1;
+        }
+    }
+    dirstream_close(st->ds);
+
+    for (size_t off = 0; off < l_subdirs;) {
+        size_t namlen = strlen(subdirs + off);
+        memcpy(current + len + 1, subdirs + off, namlen + 1);
+        scan_dir(st, current, len + 1 + namlen, depth + 1);
+        off += namlen + 1;
+    }
+
+    free(subdirs);
+    free(current);
+}
+
+// Forget everything below the directory and read it again
+static void rescan_dir(daemon_state *st, const char *path, size_t len) {
+    char *copy = strndup(path, len);
+    filetree_remove(st->tree, copy, len, forget, st);
+    int depth = depth_of(st, copy, len);
+    if (depth > 0) {
+        filetree_add(st->tree, copy, len, DT_DIR, false);
+    }
+    scan_dir(st, copy, len, depth);
+    free(copy);
+}
+
+// Start over after the kernel dropped events
+static void rescan_all(daemon_state *st) {
+    forget_all(st);
+    close(st->inotify);
+    st->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    filetree_free(st->tree);
+    st->tree = filetree_new();
+    for (size_t i = 0; i < st->nroots; ++i) {
+        scan_dir(st, st->roots[i], strlen(st->roots[i]), 0);
+    }
+}
+
+static void handle_event(daemon_state *st, const struct inotify_event *ev) {
+    // A changed exclude file affects the whole repository
+    if (!st->opt->no_ignore && ev->len > 0
+        && strcmp(ev->name, "exclude") == 0) {
+        dir_rules *r = exclude_of(st, ev->wd);
+        if (r != NULL) {
+            size_t l_repo;
+            const char *repo = filetree_dir_path(r->dir, &l_repo);
+            rescan_dir(st, repo, l_repo);
+            return;
+        }
+    }
+
+    filetree_dir *d = filetree_find_watch(st->tree, ev->wd);
+    if (d == NULL) {
+        return;
+    }
+
+    size_t l_dir;
+    const char *dir = filetree_dir_path(d, &l_dir);
+
+    // Below the roots the parent reports deleted and moved directories.
+    // A root is not watched from above, so drop it once it is gone.
+    if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+        if (depth_of(st, dir, l_dir) == 0) {
+            fprintf(stderr, "ff: %s: Root was %s, no longer watching it\n",
+                    dir, ev->mask & IN_DELETE_SELF ? "deleted" : "moved");
+            char *copy = strndup(dir, l_dir);
+            filetree_remove(st->tree, copy, l_dir, forget, st);
+            free(copy);
+        }
+        return;
+    }
+    if (ev->len == 0) {
+        return;
+    }
+
+    // Any change of a .gitignore changes which entries are visible in
+    // the whole subtree
+    if (!st->opt->no_ignore && strcmp(ev->name, ".gitignore") == 0) {
+        rescan_dir(st, dir, l_dir);
+        return;
+    }
+    if (!(ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))) {
+        return;
+    }
+    size_t namlen = strlen(ev->name);
+    size_t len = l_dir + 1 + namlen;
+    char *path = (char *)malloc((len + 1) * sizeof(char));
+    memcpy(path, dir, l_dir);
+    path[l_dir] = '/';
+    memcpy(path + l_dir + 1, ev->name, namlen + 1);
+
+    if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        filetree_remove(st->tree, path, len, forget, st);
+    }
+
+    if ((ev->mask & (IN_CREATE | IN_MOVED_TO))
+        && !(st->opt->skip_hidden && ev->name[0] == '.')) {
+        unsigned char type = DT_DIR;
+        struct stat statbuf;
+        if (!(ev->mask & IN_ISDIR)) {
+            type = lstat(path, &statbuf) == 0 ? IFTODT(statbuf.st_mode)
+                                              : DT_UNKNOWN;
+        }
+        gitignore *repo = repo_of(st, d);
+        if (type != DT_UNKNOWN
+            && (repo == NULL || !gitignore_is_ignored(repo, path, len, type))) {
+            filetree_add(st->tree, path, len, type, false);
+            if (type == DT_DIR) {
+                scan_dir(st, path, len, depth_of(st, path, len));
+            }
+        }
+    }
+
+    free(path);
+}
+
+static void handle_events(daemon_state *st) {
+    char buf[64 * 1024]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(st->inotify, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+        for (char *p = buf; p < buf + n;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                rescan_all(st);
+                break;
+            }
+            handle_event(st, ev);
+        }
+    }
+}
+
+typedef struct {
+    daemon_state *st;
+    const options *opt;
+    regex *re;
+    regex_storage *mem;
+    client *c;
+    // the full path of the current entry
+    char *path;
+    size_t size;
+    // the directory of the previous entry and whether its entries are
+    // left out
+    const char *dir;
+    bool skip_dir;
+} query;
+
+// Whether the daemon has all the entries the traversal options of the
+// query ask for.  Those it has in excess are left out of the answer.
+static bool can_answer(const options *const opt, const query_header *h) {
+    return (h->no_ignore != 0) == opt->no_ignore
+           && (h->skip_hidden != 0 || !opt->skip_hidden)
+           && (opt->max_depth <= 0
+               || (h->max_depth > 0 && h->max_depth <= opt->max_depth));
+}
+
+// Whether the entries of the directory are beyond the depth or in a
+// hidden directory, for a query which asks for less than the daemon has
+static bool skip_dir(query *q, const char *dir, size_t l_dir) {
+    size_t l_root = root_length(q->st, dir, l_dir);
+    if (l_root == 0) {
+        return true;
+    }
+    int depth = 0;
+    for (size_t i = l_root; i < l_dir; ++i) {
+        if (dir[i] != '/') {
+            continue;
+        }
+        ++depth;
+        if (q->opt->skip_hidden && i + 1 < l_dir && dir[i + 1] == '.') {
+            return true;
+        }
+    }
+    return q->opt->max_depth > 0 && depth >= q->opt->max_depth;
+}
+
+// Append to the answer which is still to be sent
+static void client_put(client *c, const void *data, size_t len) {
+    if (c->l_out + len > c->s_out) {
+        while (c->l_out + len > c->s_out) {
+            c->s_out = c->s_out ? 2 * c->s_out : ANSWER_BATCH_SIZE;
+        }
+        c->out = (char *)realloc(c->out, c->s_out * sizeof(char));
+    }
+    memcpy(c->out + c->l_out, data, len);
+    c->l_out += len;
+}
+
+static void answer_entry(void *ctx, const char *dir, size_t l_dir,
+                         const filetree_entry *entry) {
+    query *q = (query *)ctx;
+    if (dir != q->dir) {
+        q->dir = dir;
+        q->skip_dir = skip_dir(q, dir, l_dir);
+    }
+    if (q->skip_dir || (q->opt->skip_hidden && entry->name[0] == '.')) {
+        return;
+    }
+
+    size_t len = l_dir + 1 + entry->namlen;
+    if (len + 1 > q->size) {
+        q->size = 2 * (len + 1);
+        q->path = (char *)realloc(q->path, q->size * sizeof(char));
+    }
+    memcpy(q->path, dir, l_dir);
+    q->path[l_dir] = '/';
+    memcpy(q->path + l_dir + 1, entry->name, entry->namlen + 1);
+
+    size_t tag;
+    if (!match_entry(q->path, len, entry->namlen, entry->type, q->opt, q->re,
+                     q->mem, &tag)) {
+        return;
+    }
+    char type = (char)entry->type;
+    client_put(q->c, &type, 1);
+    if (q->opt->tag) {
+        uint32_t t = (uint32_t)tag;
+        client_put(q->c, &t, sizeof(t));
+    }
+    client_put(q->c, q->path, len + 1);
+}
+
+// The length of the query once its header has arrived, or 0 if the
+// header is malformed
+static size_t query_length(const query_header *h) {
+    if (h->l_patterns > QUERY_MAX_STRING || h->l_ext > QUERY_MAX_STRING
+        || h->mode > REGEX || h->npatterns > h->l_patterns
+        || (h->mode != NONE && h->npatterns == 0)) {
+        return 0;
+    }
+    return sizeof(query_header) + h->l_patterns + h->l_ext;
+}
+
+// Work out the whole answer to the query which has arrived, so the tree
+// may change while it is sent.  False if the query is malformed.
+static bool answer(daemon_state *st, client *c) {
+    query_header h;
+    memcpy(&h, c->in, sizeof(h));
+    char buf[QUERY_MAX_STRING + 1];
+    char ext[QUERY_MAX_STRING + 1];
+    memcpy(buf, c->in + sizeof(h), h.l_patterns);
+    memcpy(ext, c->in + sizeof(h) + h.l_patterns, h.l_ext);
+    buf[h.l_patterns] = '\0';
+    ext[h.l_ext] = '\0';
+
+    // Split the patterns, each of which is terminated by NUL
+    const char **patterns =
+        (const char **)malloc((h.npatterns + 1) * sizeof(char *));
+    size_t npatterns = 0;
+    for (size_t pos = 0; pos < h.l_patterns && npatterns < h.npatterns;
+         pos += strlen(buf + pos) + 1) {
+        patterns[npatterns++] = buf + pos;
+    }
+    if (npatterns != h.npatterns) {
+        free(patterns);
+        return false;
+    }
+
+    // A query for entries the daemon does not have is sent back with
+    // the roots to search
+    if (!can_answer(st->opt, &h)) {
+        free(patterns);
+        char status = ANSWER_REFUSED;
+        client_put(c, &status, 1);
+        for (size_t i = 0; i < st->nroots; ++i) {
+            client_put(c, st->roots[i], strlen(st->roots[i]) + 1);
+        }
+        return true;
+    }
+
+    // The traversal options are the daemon's, narrowed to those of the
+    // query
+    options opt = *st->opt;
+    opt.max_depth = h.max_depth;
+    opt.skip_hidden = h.skip_hidden != 0;
+    opt.mode = (match_mode)h.mode;
+    opt.icase = h.icase != 0;
+    opt.only_type = (unsigned char)h.only_type;
+    opt.tag = h.tag != 0;
+    opt.ext = h.l_ext > 0 ? ext : NULL;
+    opt.patterns = patterns;
+    opt.npatterns = npatterns;
+
+    query q;
+    q.st = st;
+    q.opt = &opt;
+    q.c = c;
+    q.dir = NULL;
+    q.skip_dir = false;
+    q.re = NULL;
+    q.mem = NULL;
+    q.path = NULL;
+    q.size = 0;
+    char error[REGEX_ERROR_SIZE];
+    switch (opt.mode) {
+    case REGEX:
+        // The client has compiled the pattern already, but its regex
+        // engine may not be the same
+        if ((q.re = regex_try_compile(patterns, npatterns, opt.icase, error))
+            == NULL) {
+            free(patterns);
+            char status = ANSWER_ERROR;
+            client_put(c, &status, 1);
+            client_put(c, error, strlen(error) + 1);
+            return true;
+        }
+        q.mem = regex_storage_new(q.re);
+        break;
+    case GLOB:
+        opt.match.gl = glob_compile(patterns, npatterns, opt.icase);
+        break;
+    case NONE:
+        break;
+    }
+
+    char status = ANSWER_OK;
+    client_put(c, &status, 1);
+    filetree_visit(st->tree, answer_entry, &q);
+
+    if (opt.mode == REGEX) {
+        regex_storage_free(q.mem);
+        regex_free(q.re);
+    } else if (opt.mode == GLOB) {
+        glob_free(opt.match.gl);
+    }
+    free(q.path);
+    free(patterns);
+    return true;
+}
+
+// Send as much of the answer as the socket takes.  False once the
+// client is done with, because it has all of it or went away.
+static bool client_send(client *c) {
+    while (c->off_out < c->l_out) {
+        ssize_t n = write(c->fd, c->out + c->off_out, c->l_out - c->off_out);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->off_out += (size_t)n;
+    }
+    return false;
+}
+
+// Read as much of the query as has arrived and answer it once it is
+// complete.  False if the client is to be dropped.
+static bool client_receive(daemon_state *st, client *c) {
+    for (;;) {
+        size_t want = sizeof(query_header);
+        if (c->l_in >= sizeof(query_header)) {
+            query_header h;
+            memcpy(&h, c->in, sizeof(h));
+            if ((want = query_length(&h)) == 0) {
+                return false;
+            }
+            if (c->l_in == want) {
+                // Apply all pending changes before answering
+                handle_events(st);
+                if (!answer(st, c)) {
+                    return false;
+                }
+                c->answered = true;
+                return client_send(c);
+            }
+        }
+        ssize_t n = read(c->fd, c->in + c->l_in, want - c->l_in);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return true;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        c->l_in += (size_t)n;
+    }
+}
+
+static void client_add(daemon_state *st, int fd) {
+    if (st->nclients == st->aclients) {
+        st->aclients = st->aclients ? 2 * st->aclients : 8;
+        st->clients =
+            (client *)realloc(st->clients, st->aclients * sizeof(client));
+    }
+    client *c = &st->clients[st->nclients++];
+    c->fd = fd;
+    c->in = (char *)malloc(QUERY_MAX_LENGTH * sizeof(char));
+    c->l_in = 0;
+    c->out = NULL;
+    c->l_out = 0;
+    c->s_out = 0;
+    c->off_out = 0;
+    c->answered = false;
+    c->last = now();
+}
+
+static void client_drop(daemon_state *st, size_t i) {
+    client *c = &st->clients[i];
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    st->clients[i] = st->clients[--st->nclients];
+}
+
+static void load_dir(void *ctx, const char *path, size_t len,
+                     const fileindex_stamp *stamp) {
+    daemon_state *st = (daemon_state *)ctx;
+    filetree_dir *d = filetree_add_dir(st->tree, path, len);
+    add_watch(st, d);
+
+    // The directory changed while it was crawled, before the watch
+    // was set up.  Mark it to be read again.
+    struct stat statbuf;
+    if (stat(path, &statbuf) != 0
+        || statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec
+               != stamp->mtime
+        || statbuf.st_ctim.tv_sec * 1000000000LL + statbuf.st_ctim.tv_nsec
+               != stamp->ctime) {
+        *filetree_dir_data(d) = (void *)&stale;
+    }
+}
+
+static void load_entry(void *ctx, const char *path, size_t len,
+                       unsigned char type) {
+    daemon_state *st = (daemon_state *)ctx;
+    filetree_add(st->tree, path, len, type, true);
+}
+
+// The stale directories are collected before any of them is read
+// again, so that no marker is mistaken for ignore rules meanwhile
+typedef struct {
+    daemon_state *st;
+    char *paths;
+    size_t len;
+    size_t size;
+} stale_list;
+
+static void collect_stale(void *ctx, const char *path, size_t len,
+                          const fileindex_stamp *stamp) {
+    (void)stamp;
+    stale_list *l = (stale_list *)ctx;
+    filetree_dir *d = filetree_find(l->st->tree, path, len);
+    if (d == NULL || *filetree_dir_data(d) != (void *)&stale) {
+        return;
+    }
+    *filetree_dir_data(d) = NULL;
+    if (l->len + len + 1 > l->size) {
+        while (l->len + len + 1 > l->size) {
+            l->size = l->size ? 2 * l->size : 256;
+        }
+        l->paths = (char *)realloc(l->paths, l->size * sizeof(char));
+    }
+    memcpy(l->paths + l->len, path, len);
+    l->paths[l->len + len] = '\0';
+    l->len += len + 1;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) {
+        return -1;
+    }
+
+    // Don't take over the socket of a daemon which is still running
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "%s: Another daemon is listening\n", path);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(fd, SOMAXCONN) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int daemon_serve(const options *const opt, fileindex_builder **b, size_t n,
+                 const char **roots, size_t nroots) {
+    int listener = listen_on(opt->socket_path);
+    if (listener < 0) {
+        return 1;
+    }
+
+    daemon_state st;
+    st.opt = opt;
+    st.tree = filetree_new();
+    st.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    st.ds = dirstream_new();
+    st.roots = roots;
+    st.nroots = nroots;
+    st.repos = NULL;
+    st.nrepos = 0;
+    st.arepos = 0;
+    st.out_of_watches = false;
+    st.clients = NULL;
+    st.nclients = 0;
+    st.aclients = 0;
+    if (st.inotify < 0) {
+        perror("inotify");
+    }
+
+    // Take over the results of the crawl.  All directories have to be
+    // known before their entries are added.
+    for (size_t i = 0; i < n; ++i) {
+        fileindex_builder_visit(b[i], load_dir, NULL, &st);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        fileindex_builder_visit(b[i], NULL, load_entry, &st);
+    }
+    stale_list l = {&st, NULL, 0, 0};
+    for (size_t i = 0; i < n; ++i) {
+        fileindex_builder_visit(b[i], collect_stale, NULL, &l);
+    }
+    for (size_t off = 0; off < l.len;) {
+        size_t len = strlen(l.paths + off);
+        rescan_dir(&st, l.paths + off, len);
+        off += len + 1;
+    }
+    free(l.paths);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct pollfd *fds = NULL;
+    size_t afds = 0;
+    while (!stopped) {
+        if (2 + st.nclients > afds) {
+            afds = 2 * (2 + st.nclients);
+            fds = (struct pollfd *)realloc(fds, afds * sizeof(struct pollfd));
+        }
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        fds[1].fd = st.inotify;
+        fds[1].events = POLLIN;
+        for (size_t i = 0; i < st.nclients; ++i) {
+            fds[2 + i].fd = st.clients[i].fd;
+            fds[2 + i].events = st.clients[i].answered ? POLLOUT : POLLIN;
+        }
+        // Wake up now and then to drop clients which went quiet
+        if (poll(fds, 2 + st.nclients, st.nclients > 0 ? 1000 : -1) < 0) {
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            handle_events(&st);
+        }
+
+        // Going backwards, a dropped client is replaced by one which
+        // has been served already
+        time_t t = now();
+        for (size_t i = st.nclients; i-- > 0;) {
+            client *c = &st.clients[i];
+            bool keep = true;
+            if (fds[2 + i].revents != 0) {
+                c->last = t;
+                keep = c->answered ? client_send(c) : client_receive(&st, c);
+            } else if (t - c->last > CLIENT_TIMEOUT) {
+                keep = false;
+            }
+            if (!keep) {
+                client_drop(&st, i);
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept4(listener, NULL, NULL,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC))
+                   >= 0) {
+                client_add(&st, fd);
+            }
+        }
+    }
+
+    while (st.nclients > 0) {
+        client_drop(&st, st.nclients - 1);
+    }
+    free(st.clients);
+    free(fds);
+    close(listener);
+    unlink(opt->socket_path);
+    forget_all(&st);
+    free(st.repos);
+    dirstream_free(st.ds);
+    close(st.inotify);
+    filetree_free(st.tree);
+    return 0;
+}
+
+typedef struct {
+    const char *path;
+    size_t len;
+    unsigned char type;
+    size_t tag;
+} result;
+
+static int result_cmp(const void *a, const void *b) {
+    return strcoll(((const result *)a)->path, ((const result *)b)->path);
+}
+
+// The absolute path as seen from the working directory cwd, which has
+// no trailing slash, e.g. "./c" for /a/b/c or "../d" for /a/d from
+// /a/b, like the paths of a direct search.  The path is allocated
+// from the arena.
+static const char *relative_path(arena *a, const char *cwd, size_t l_cwd,
+                                 const char *path, size_t *len) {
+    if (path[0] != '/') {
+        return path;
+    }
+
+    // The longest common prefix which ends a component of both
+    size_t common = 0;
+    for (size_t i = 0; i <= l_cwd && i <= *len; ++i) {
+        if ((i == l_cwd || cwd[i] == '/') && (i == *len || path[i] == '/')) {
+            common = i;
+        }
+        if (i == l_cwd || i == *len || cwd[i] != path[i]) {
+            break;
+        }
+    }
+    size_t up = 0;
+    for (size_t i = common; i < l_cwd; ++i) {
+        up += cwd[i] == '/';
+    }
+
+    size_t l_rel = (up > 0 ? 3 * up - 1 : 1) + *len - common;
+    char *rel = (char *)arena_alloc(a, l_rel + 1);
+    char *p = rel;
+    if (up == 0) {
+        *p++ = '.';
+    }
+    for (size_t i = 0; i < up; ++i) {
+        memcpy(p, i > 0 ? "/.." : "..", i > 0 ? 3 : 2);
+        p += i > 0 ? 3 : 2;
+    }
+    memcpy(p, path + common, *len - common);
+    rel[l_rel] = '\0';
+    *len = l_rel;
+    return rel;
+}
+
+int daemon_query(const options *const opt, const char ***roots,
+                 size_t *nroots) {
+    struct sockaddr_un addr;
+    if (!socket_address(opt->socket_path, &addr)) {
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror(opt->socket_path);
+        close(fd);
+        return 1;
+    }
+
+    query_header h;
+    h.mode = (uint32_t)opt->mode;
+    h.icase = opt->icase;
+    h.only_type = opt->only_type;
+    h.tag = opt->tag;
+    h.max_depth = opt->max_depth > 0 && opt->max_depth <= INT32_MAX
+                      ? (int32_t)opt->max_depth
+                      : 0;
+    h.skip_hidden = opt->skip_hidden;
+    h.no_ignore = opt->no_ignore;
+    h.npatterns = (uint32_t)opt->npatterns;
+    size_t l_patterns = 0;
+    for (size_t i = 0; i < opt->npatterns; ++i) {
+        l_patterns += strlen(opt->patterns[i]) + 1;
+    }
+    h.l_patterns = (uint32_t)l_patterns;
+    h.l_ext = opt->ext != NULL ? (uint32_t)strlen(opt->ext) : 0;
+    if (l_patterns > QUERY_MAX_STRING || h.l_ext > QUERY_MAX_STRING) {
+        fputs("Pattern too long\n", stderr);
+        close(fd);
+        return 1;
+    }
+    bool sent = write_all(fd, &h, sizeof(h));
+    for (size_t i = 0; sent && i < opt->npatterns; ++i) {
+        sent = write_all(fd, opt->patterns[i], strlen(opt->patterns[i]) + 1);
+    }
+    if (!sent || !write_all(fd, opt->ext, h.l_ext)) {
+        perror(opt->socket_path);
+        close(fd);
+        return 1;
+    }
+    shutdown(fd, SHUT_WR);
+
+    // Collect the whole answer
+    size_t len = 0, size = 64 * 1024;
+    char *buf = (char *)malloc(size * sizeof(char));
+    for (;;) {
+        if (len == size) {
+            size *= 2;
+            buf = (char *)realloc(buf, size * sizeof(char));
+        }
+        ssize_t nread = read(fd, buf + len, size - len);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        }
+        if (nread <= 0) {
+            break;
+        }
+        len += (size_t)nread;
+    }
+    close(fd);
+
+    // The full paths of the daemon are shown relative to the working
+    // directory unless -a asks for them, and are looked up that way
+    // for the metadata, the colors and --exec as well
+    char *cwd = opt->absolute ? NULL : getcwd(NULL, 0);
+    size_t l_cwd = cwd != NULL ? strlen(cwd) : 0;
+    if (l_cwd == 1) {
+        l_cwd = 0;
+    }
+    arena *rel = cwd != NULL ? arena_new(ANSWER_BATCH_SIZE) : NULL;
+
+    // A pattern the daemon could not compile is reported as it would
+    // be by a direct search
+    if (len == 0 || (buf[0] != ANSWER_OK && buf[0] != ANSWER_REFUSED)) {
+        if (len > 0 && buf[0] == ANSWER_ERROR) {
+            fprintf(stderr, "%.*s\n", (int)strnlen(buf + 1, len - 1),
+                    buf + 1);
+        } else {
+            fprintf(stderr, "%s: No answer\n", opt->socket_path);
+        }
+        free(cwd);
+        if (rel != NULL) {
+            arena_free(rel);
+        }
+        free(buf);
+        return 1;
+    }
+
+    // Hand the roots back if the daemon can not answer.  The array and
+    // the paths are one allocation.
+    if (buf[0] == ANSWER_REFUSED) {
+        size_t n = 0, l_paths = 0;
+        for (size_t pos = 1; pos < len; ++pos) {
+            n += buf[pos] == '\0';
+        }
+        const char **found = (const char **)malloc(n * sizeof(char *));
+        for (size_t i = 0, pos = 1; i < n; ++i) {
+            size_t l_root = strlen(buf + pos);
+            found[i] = cwd != NULL
+                           ? relative_path(rel, cwd, l_cwd, buf + pos, &l_root)
+                           : buf + pos;
+            l_paths += l_root + 1;
+            pos += strlen(buf + pos) + 1;
+        }
+        *roots = (const char **)malloc(n * sizeof(char *) + l_paths);
+        char *paths = (char *)(*roots + n);
+        for (size_t i = 0; i < n; ++i) {
+            size_t l_root = strlen(found[i]) + 1;
+            memcpy(paths, found[i], l_root);
+            (*roots)[i] = paths;
+            paths += l_root;
+        }
+        *nroots = n;
+        free(found);
+        free(cwd);
+        if (rel != NULL) {
+            arena_free(rel);
+        }
+        free(buf);
+        return DAEMON_REFUSED;
+    }
+
+    size_t cnt = 0, alloc = 1024;
+    result *results = (result *)malloc(alloc * sizeof(result));
+    const size_t l_head = 1 + (opt->tag ? sizeof(uint32_t) : 0);
+    for (size_t pos = 1; pos + l_head < len;) {
+        const char *path = buf + pos + l_head;
+        const char *end =
+            (const char *)memchr(path, '\0', len - pos - l_head);
+        if (end == NULL) {
+            break;
+        }
+        uint32_t tag = 0;
+        if (opt->tag) {
+            memcpy(&tag, buf + pos + 1, sizeof(tag));
+            if (tag >= opt->npatterns) {
+                break;
+            }
+        }
+        if (cnt == alloc) {
+            alloc *= 2;
+            results = (result *)realloc(results, alloc * sizeof(result));
+        }
+        results[cnt].len = (size_t)(end - path);
+        results[cnt].path =
+            cwd != NULL
+                ? relative_path(rel, cwd, l_cwd, path, &results[cnt].len)
+                : path;
+        results[cnt].type = (unsigned char)buf[pos];
+        results[cnt].tag = tag;
+        ++cnt;
+        pos = (size_t)(end - buf) + 1;
+    }
+
+    if (!opt->unsorted && cnt > 1) {
+        qsort(results, cnt, sizeof(result), result_cmp);
+    }
+
+    outbuf *out = outbuf_new(fileno(stdout));
+    for (size_t i = 0; i < cnt && !limiter_stopped(opt->limit); ++i) {
+        // The metadata is looked up here rather than by the daemon, so
+        // it is seen with the permissions of the user asking
+        unsigned mode = 0;
+        if (opt->meta.fields != 0
+            && !match_metadata(AT_FDCWD, results[i].path,
+                               opt->colorize ? &mode : NULL, opt)) {
+            continue;
+        }
+        print_path(out, results[i].path, results[i].len, results[i].type,
+                   mode, results[i].tag, opt);
+        if (outbuf_length(out) >= ANSWER_BATCH_SIZE) {
+            outbuf_flush(out);
+        }
+    }
+    outbuf_free(out);
+
+    free(results);
+    free(cwd);
+    if (rel != NULL) {
+        arena_free(rel);
+    }
+    free(buf);
+    return 0;
+}
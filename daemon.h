@@ -0,0 +1,17 @@
+#pragma once
+
+#include "fileindex.h"
+#include "options.h"
+
+// C standard library
+#include <stddef.h>
+
+int daemon_serve(const options *const opt, fileindex_builder **b, size_t n,
+                 const char **roots, size_t nroots);
+// Returned by daemon_query if the daemon does not have the entries the
+// traversal options ask for.  The roots it watches are handed back to
+// be searched directly, the caller frees the array.
+#define DAEMON_REFUSED -1
+
+int daemon_query(const options *const opt, const char ***roots,
+                 size_t *nroots);
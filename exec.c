@@ -0,0 +1,355 @@
+#include "exec.h"
+
+// C standard library
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Room left for the environment and the kernel's bookkeeping when the
+// arguments of a batch are measured against ARG_MAX
+#define EXEC_ARG_SLACK 4096
+
+struct _exec_pool {
+    // The command, where {} stands for the path.  Without one the path
+    // is appended.
+    char *const *argv;
+    size_t argc;
+    bool placeholder;
+    bool batch;
+
+    // At most max children run at the same time.  A submitter reserves
+    // a slot under the lock but spawns without it, so the workers only
+    // queue up while all slots are taken.  The children are reaped by a
+    // thread of their own, which wakes up the submitters waiting for a
+    // free slot.
+    long max;
+    long running;
+    bool done;
+    int status;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t reaper;
+
+    // Children we started and did not reap yet.  Other children of the
+    // process are left alone.
+    pid_t *pids;
+    size_t npids;
+
+    // Paths of the pending batch, separated by NUL, and the number of
+    // bytes they are allowed to take up.  Each path is passed as often
+    // as there are {} in the command.
+    char *paths;
+    size_t len;
+    size_t size;
+    size_t npaths;
+    size_t used;
+    size_t copies;
+    size_t limit;
+};
+
+static bool pid_remove(exec_pool *p, pid_t pid) {
+    for (size_t i = 0; i < p->npids; ++i) {
+        if (p->pids[i] == pid) {
+            p->pids[i] = p->pids[--p->npids];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *reap(void *arg) {
+    exec_pool *p = (exec_pool *)arg;
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        // A slot may be reserved for a child which is still being
+        // spawned, so wait until it is recorded
+        while (p->npids == 0 && !(p->done && p->running == 0)) {
+            pthread_cond_wait(&p->cond, &p->lock);
+        }
+        if (p->npids == 0) {
+            break;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        // Find out which child exited without reaping it.  If it is not
+        // one of ours, or not recorded yet, wait for our oldest instead.
+        siginfo_t info;
+        memset(&info, 0, sizeof(info));
+        pid_t pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) == 0) {
+            pid = info.si_pid;
+        }
+        pthread_mutex_lock(&p->lock);
+        bool ours = false;
+        for (size_t i = 0; i < p->npids; ++i) {
+            ours = ours || p->pids[i] == pid;
+        }
+        if (!ours) {
+            pid = p->pids[0];
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int wstatus;
+        pid_t reaped;
+        while ((reaped = waitpid(pid, &wstatus, 0)) < 0 && errno == EINTR) {
+        }
+
+        pthread_mutex_lock(&p->lock);
+        if (reaped == pid) {
+            if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+                p->status = 1;
+            }
+        } else {
+            p->status = 1;
+        }
+        pid_remove(p, pid);
+        --p->running;
+        pthread_cond_broadcast(&p->cond);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+exec_pool *exec_pool_new(char *const *argv, size_t argc, bool batch,
+                         long nprocs) {
+    assert(argc > 0);
+    exec_pool *p = (exec_pool *)malloc(sizeof(exec_pool));
+    p->argv = argv;
+    p->argc = argc;
+    p->batch = batch;
+    p->placeholder = false;
+    size_t nplaceholders = 0;
+    for (size_t i = 0; i < argc; ++i) {
+        p->placeholder = p->placeholder
+                         || (batch ? strcmp(argv[i], "{}") == 0
+                                   : strstr(argv[i], "{}") != NULL);
+        nplaceholders += strcmp(argv[i], "{}") == 0;
+    }
+
+    p->max = nprocs > 0 ? nprocs : 1;
+    p->running = 0;
+    p->done = false;
+    p->status = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    p->pids = (pid_t *)malloc((size_t)p->max * sizeof(pid_t));
+    p->npids = 0;
+
+    p->paths = NULL;
+    p->len = 0;
+    p->size = 0;
+    p->npaths = 0;
+    p->used = 0;
+    p->copies = nplaceholders > 0 ? nplaceholders : 1;
+    p->limit = 0;
+    if (batch) {
+        long arg_max = sysconf(_SC_ARG_MAX);
+        size_t used = EXEC_ARG_SLACK;
+        for (char **env = environ; *env != NULL; ++env) {
+            used += strlen(*env) + 1 + sizeof(char *);
+        }
+        for (size_t i = 0; i < argc; ++i) {
+            used += strlen(argv[i]) + 1 + sizeof(char *);
+        }
+        p->limit = arg_max > 0 && (size_t)arg_max > used + 4096
+                       ? (size_t)arg_max - used
+                       : 4096;
+        p->size = 4096;
+        p->paths = (char *)malloc(p->size * sizeof(char));
+    }
+
+    pthread_create(&p->reaper, NULL, reap, p);
+    return p;
+}
+
+// Substitute the path for every {} of an argument
+static char *substitute(const char *arg, const char *path, size_t len) {
+    size_t n = 0;
+    for (const char *s = arg; (s = strstr(s, "{}")) != NULL; s += 2) {
+        ++n;
+    }
+    size_t l_arg = strlen(arg);
+    char *out = (char *)malloc((l_arg + n * len + 1) * sizeof(char));
+    char *o = out;
+    for (const char *s = arg, *t; *s != '\0'; s = t + 2) {
+        if ((t = strstr(s, "{}")) == NULL) {
+            o = stpcpy(o, s);
+            break;
+        }
+        memcpy(o, s, (size_t)(t - s));
+        o += t - s;
+        memcpy(o, path, len);
+        o += len;
+    }
+    *o = '\0';
+    return out;
+}
+
+// Start the command, waiting for a free slot.  Called without the
+// lock, which is only held to reserve the slot and record the child.
+static void spawn(exec_pool *p, char **argv) {
+    pthread_mutex_lock(&p->lock);
+    while (p->running >= p->max) {
+        pthread_cond_wait(&p->cond, &p->lock);
+    }
+    ++p->running;
+    pthread_mutex_unlock(&p->lock);
+
+    // The children would compete for our standard input
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                     O_RDONLY, 0);
+    pid_t pid;
+    int rc = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    pthread_mutex_lock(&p->lock);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(rc));
+        p->status = 1;
+        --p->running;
+    } else {
+        p->pids[p->npids++] = pid;
+    }
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void spawn_one(exec_pool *p, const char *path, size_t len) {
+    char **argv = (char **)malloc((p->argc + 2) * sizeof(char *));
+    size_t n = 0;
+    for (size_t i = 0; i < p->argc; ++i) {
+        argv[n++] = p->placeholder ? substitute(p->argv[i], path, len)
+                                   : strdup(p->argv[i]);
+    }
+    if (!p->placeholder) {
+        argv[n++] = strndup(path, len);
+    }
+    argv[n] = NULL;
+
+    spawn(p, argv);
+
+    for (size_t i = 0; i < n; ++i) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+// Take the pending batch out of the pool, so submitters can fill the
+// next one while it is started.  Called with the lock held.  Returns
+// NULL if there is nothing pending.
+static char *take_batch(exec_pool *p, size_t *len, size_t *npaths) {
+    if (p->npaths == 0) {
+        return NULL;
+    }
+    char *paths = p->paths;
+    *len = p->len;
+    *npaths = p->npaths;
+    p->paths = (char *)malloc(p->size * sizeof(char));
+    p->len = 0;
+    p->npaths = 0;
+    p->used = 0;
+    return paths;
+}
+
+// Start a batch, where each {} takes all of its paths.  Called without
+// the lock.
+static void spawn_batch(exec_pool *p, char *paths, size_t len,
+                        size_t npaths) {
+    if (paths == NULL) {
+        return;
+    }
+    size_t nargs = p->argc + p->copies * npaths;
+    char **argv = (char **)malloc((nargs + 1) * sizeof(char *));
+
+    size_t n = 0;
+    for (size_t i = 0; i <= p->argc; ++i) {
+        bool expand = i < p->argc ? strcmp(p->argv[i], "{}") == 0
+                                  : !p->placeholder;
+        if (expand) {
+            for (char *s = paths; s < paths + len; s += strlen(s) + 1) {
+                argv[n++] = s;
+            }
+        } else if (i < p->argc) {
+            argv[n++] = p->argv[i];
+        }
+    }
+    argv[n] = NULL;
+
+    spawn(p, argv);
+    free(argv);
+    free(paths);
+}
+
+void exec_pool_submit(exec_pool *p, const char *path, size_t len) {
+    if (!p->batch) {
+        spawn_one(p, path, len);
+        return;
+    }
+
+    char *full = NULL;
+    size_t full_len = 0, full_npaths = 0;
+    pthread_mutex_lock(&p->lock);
+    size_t cost = (len + 1 + sizeof(char *)) * p->copies;
+    if (p->npaths > 0 && p->used + cost > p->limit) {
+        full = take_batch(p, &full_len, &full_npaths);
+    }
+    if (p->len + len + 1 > p->size) {
+        while (p->len + len + 1 > p->size) {
+            p->size *= 2;
+        }
+        p->paths = (char *)realloc(p->paths, p->size * sizeof(char));
+    }
+    memcpy(p->paths + p->len, path, len);
+    p->paths[p->len + len] = '\0';
+    p->len += len + 1;
+    p->used += cost;
+    ++p->npaths;
+    pthread_mutex_unlock(&p->lock);
+
+    spawn_batch(p, full, full_len, full_npaths);
+}
+
+// Run the last batch and wait for all children.  Returns 1 if any of
+// them failed, 0 otherwise.
+int exec_pool_finish(exec_pool *p) {
+    if (p->batch) {
+        size_t len = 0, npaths = 0;
+        pthread_mutex_lock(&p->lock);
+        char *paths = take_batch(p, &len, &npaths);
+        pthread_mutex_unlock(&p->lock);
+        spawn_batch(p, paths, len, npaths);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->done = true;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->reaper, NULL);
+    return p->status;
+}
+
+void exec_pool_free(exec_pool *p) {
+    if (p == NULL) {
+        return;
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+    free(p->pids);
+    free(p->paths);
+    free(p);
+    p = NULL;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+// Runs a command for every result, or for batches of them, in child
+// processes which are started while the search goes on
+typedef struct _exec_pool exec_pool;
+
+exec_pool *exec_pool_new(char *const *argv, size_t argc, bool batch,
+                         long nprocs);
+void exec_pool_submit(exec_pool *p, const char *path, size_t len);
+int exec_pool_finish(exec_pool *p);
+void exec_pool_free(exec_pool *p);
@@ -2,12 +2,22 @@
 #define _GNU_SOURCE
 #endif
 
-#include "dircolors.h"
+#include "arena.h"
+#include "daemon.h"
+#include "dirstream.h"
+#include "exec.h"
+#include "fileindex.h"
 #include "flagman.h"
 #include "gitignore.h"
+#include "glob.h"
+#include "limiter.h"
+#include "match.h"
 #include "message.h"
 #include "options.h"
+#include "outbuf.h"
+#include "pool.h"
 #include "regex.h"
+#include "statxbatch.h"
 
 // C standard library
 #include <assert.h>
@@ -17,8 +27,11 @@
 
 // POSIX C library
 #include <dirent.h>
-#include <fnmatch.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 
@@ -26,16 +39,46 @@ typedef struct _shared_ptr shared_ptr;
 struct _shared_ptr {
     gitignore *ptr;
     int *refcnt;
+    // The frame of the ignore rules below this one, which is kept
+    // alive as long as this one is
+    shared_ptr *parent;
+    // Fingerprint of the ignore files the rules come from, only kept
+    // track of while indexing
+    uint64_t stamp;
 };
 
+// The reference count and the parent of a shared_ptr live together in
+// one block from a pool.  The count comes first so that the block can
+// be found from it.
+typedef struct {
+    int refcnt;
+    shared_ptr parent;
+} shared_block;
+
+static pool *shared_pool = NULL;
+
 shared_ptr make_shared(gitignore *repo) {
-    int *refcnt = (int *)malloc(sizeof(int));
-    *refcnt = 1;
+    shared_block *b = (shared_block *)pool_alloc(shared_pool);
+    b->refcnt = 1;
 
     shared_ptr s;
     s.ptr = repo;
-    s.refcnt = refcnt;
+    s.refcnt = &b->refcnt;
+    s.parent = NULL;
+    s.stamp = 0;
+
+    return s;
+}
+
+shared_ptr make_shared_copy(shared_ptr s) {
+    __atomic_add_fetch(s.refcnt, 1, __ATOMIC_SEQ_CST);
+    return s;
+}
 
+shared_ptr make_shared_frame(gitignore *frame, shared_ptr parent) {
+    shared_ptr s = make_shared(frame);
+    s.parent = &((shared_block *)s.refcnt)->parent;
+    *s.parent = make_shared_copy(parent);
     return s;
 }
 
@@ -43,29 +86,108 @@ void free_shared(shared_ptr s) {
     assert(s.refcnt != NULL);
     if (__atomic_sub_fetch(s.refcnt, 1, __ATOMIC_SEQ_CST) == 0) {
         gitignore_free(s.ptr);
-        free(s.refcnt);
+        if (s.parent != NULL) {
+            free_shared(*s.parent);
+        }
+        pool_release(shared_pool, s.refcnt);
         s.refcnt = NULL;
     }
 }
 
-shared_ptr make_shared_copy(shared_ptr s) {
-    __atomic_add_fetch(s.refcnt, 1, __ATOMIC_SEQ_CST);
-    return s;
+// The ignore rules for the entries of a directory.  If it is the root
+// of a repository, these start over, otherwise its .gitignore is pushed
+// on top of the rules of the parent.  Unless the listing of the
+// directory tells which of the files exist, they are probed for.
+shared_ptr ignore_rules(const char *path, size_t len, shared_ptr repo,
+                        bool listed, bool has_git, bool has_gitignore) {
+    if (!listed) {
+        gitignore *g = gitignore_new(path);
+        if (g != NULL) {
+            return make_shared(g);
+        }
+        has_gitignore = true;
+    } else if (has_git) {
+        return make_shared(gitignore_repo(path, len));
+    }
+    if (has_gitignore && repo.ptr != NULL) {
+        gitignore *g = gitignore_push(repo.ptr, path, len);
+        if (g != NULL) {
+            return make_shared_frame(g, repo);
+        }
+    }
+    return make_shared_copy(repo);
+}
+
+// A directory descriptor shared between a directory and its queued
+// subdirectories, so that these can be opened relative to their
+// parent without resolving the whole path again.  The number of
+// descriptors kept open this way is limited by opt->max_open_dirs.
+typedef struct {
+    int fd;
+    int refcnt;
+} dirref;
+
+static long dirref_count = 0;
+
+// The bookkeeping records of every queued directory are recycled
+// through pools instead of going through malloc
+static pool *dirref_pool = NULL;
+static pool *message_body_pool = NULL;
+
+dirref *dirref_new(dirstream *ds, long max_open_dirs) {
+    if (__atomic_add_fetch(&dirref_count, 1, __ATOMIC_SEQ_CST)
+        > max_open_dirs) {
+        __atomic_sub_fetch(&dirref_count, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+
+    int fd = dirstream_detach(ds);
+    if (fd < 0) {
+        __atomic_sub_fetch(&dirref_count, 1, __ATOMIC_SEQ_CST);
+        return NULL;
+    }
+
+    dirref *d = (dirref *)pool_alloc(dirref_pool);
+    d->fd = fd;
+    d->refcnt = 1;
+    return d;
+}
+
+dirref *dirref_copy(dirref *d) {
+    if (d != NULL) {
+        __atomic_add_fetch(&d->refcnt, 1, __ATOMIC_SEQ_CST);
+    }
+    return d;
+}
+
+void dirref_free(dirref *d) {
+    if (d == NULL) {
+        return;
+    }
+    if (__atomic_sub_fetch(&d->refcnt, 1, __ATOMIC_SEQ_CST) == 0) {
+        close(d->fd);
+        __atomic_sub_fetch(&dirref_count, 1, __ATOMIC_SEQ_CST);
+        pool_release(dirref_pool, d);
+    }
 }
 
 typedef struct {
     int depth;
     size_t len;
     char *str;
+    size_t namelen;
+    dirref *at;
     shared_ptr repo;
 } message_body;
 
 message_body *message_body_new(int depth, size_t len, const char *str,
-                               shared_ptr repo) {
-    message_body *msg = (message_body *)malloc(sizeof(message_body));
+                               size_t namelen, dirref *at, shared_ptr repo) {
+    message_body *msg = (message_body *)pool_alloc(message_body_pool);
     msg->depth = depth;
     msg->len = len;
     msg->str = str ? strdup(str) : NULL;
+    msg->namelen = namelen;
+    msg->at = at;
     msg->repo = repo;
     return msg;
 }
@@ -73,30 +195,125 @@ message_body *message_body_new(int depth, size_t len, const char *str,
 void message_body_free(void *ptr) {
     message_body *msg = (message_body *)ptr;
     free(msg->str);
+    dirref_free(msg->at);
     free_shared(msg->repo);
-    free(msg);
+    pool_release(message_body_pool, msg);
 }
 
-void process_match(const char *real_path, const char *dir_name,
-                   const char *base_name, const options *const opt) {
-    if (opt->colorize) {
-        printf(DIRCOLOR_DIR "%s/" DIRCOLOR_RESET "%s%s" DIRCOLOR_RESET "%c",
-               dir_name, dircolor(real_path), base_name, opt->delimiter);
-    } else {
-        printf("%s%c", real_path, opt->delimiter);
-    }
-}
+// Results are collected in a per-thread buffer which is written out
+// once it exceeds this size, or after every directory if the output
+// goes to a terminal
+#define OUTPUT_BATCH_SIZE (32 * 1024)
+
+// Size of the blocks of the per-thread scratch arena
+#define SCRATCH_BLOCK_SIZE (256 * 1024)
+
+// Traversal options stored in an index
+#define INDEX_HIDDEN 0x1
+#define INDEX_NO_IGNORE 0x2
 
+typedef struct {
+    char *path;
+    size_t len;
+    unsigned char type;
+    unsigned mode;
+    size_t tag;
+} match;
+
+// Number of results printed so far, which the hybrid schedule counts
+// to know when to stop going shallow first
+static size_t results_count = 0;
+
+// An entry which passed the filters but whose metadata is still to
+// be checked
+typedef struct {
+    size_t namlen;
+    unsigned char type;
+    size_t tag;
+} pending_match;
+
+// The matches are sorted through pointers, because qsort moves
+// elements of pointer size much faster than whole structs
 int cmp(const void *a, const void *b) {
-    return strcoll(*(char *const *)a, *(char *const *)b);
+    return strcoll((*(const match *const *)a)->path,
+                   (*(const match *const *)b)->path);
+}
+
+// Number of entries read from a directory before any of them is looked
+// at.  A longer listing is gone through in chunks of this size, so that
+// the first results of a huge directory are not held back until all of
+// it has been read.
+#define LISTING_CHUNK 4096
+
+// Read the next entries of a listing into *entries, which grows as
+// needed, from the index if it is taken over, otherwise from the
+// directory.  The names are copied, because reading on may overwrite
+// them.  Reading is cut short once a limit has been reached.  Returns
+// whether the directory may hold more entries than were read.
+static bool read_entries(dirstream *ds, bool reuse,
+                         const fileindex_child *children, size_t nchildren,
+                         size_t *child, const options *const opt,
+                         arena *scratch, dirstream_entry **entries,
+                         size_t *nentries, size_t *len_entries,
+                         bool *has_git, bool *has_gitignore) {
+    *nentries = 0;
+    dirstream_entry entry;
+    while (!limiter_stopped(opt->limit)) {
+        if (reuse) {
+            if (*child == nchildren) {
+                return false;
+            }
+            entry.name = children[*child].name;
+            entry.namlen = children[*child].namlen;
+            entry.type = children[*child].type;
+            ++*child;
+        } else {
+            if (*nentries == LISTING_CHUNK) {
+                return true;
+            }
+            if (!dirstream_read(ds, &entry)) {
+                return false;
+            }
+            char *copy = (char *)arena_alloc(scratch, entry.namlen + 1);
+            memcpy(copy, entry.name, entry.namlen + 1);
+            entry.name = copy;
+        }
+
+        if (entry.name[0] == '.') {
+            *has_git = *has_git || strcmp(entry.name, ".git") == 0;
+            *has_gitignore =
+                *has_gitignore || strcmp(entry.name, ".gitignore") == 0;
+        }
+
+        if (__builtin_expect(*nentries == *len_entries, 0)) {
+            dirstream_entry *old_entries = *entries;
+            *len_entries *= 2;
+            *entries = (dirstream_entry *)arena_alloc(
+                scratch, *len_entries * sizeof(dirstream_entry));
+            memcpy(*entries, old_entries,
+                   *nentries * sizeof(dirstream_entry));
+        }
+        (*entries)[(*nentries)++] = entry;
+    }
+    return false;
 }
 
 void walk(const char *parent, const size_t l_parent, const options *const opt,
           const int depth,
+          // QUEUE
+          deque *self,
+          // DIRENT
+          dirref *at, const char *name, dirstream *ds,
+          // METADATA
+          statx_batch *sb,
+          // OUTPUT
+          outbuf *out,
+          // MEMORY
+          arena *scratch,
+          // INDEX
+          fileindex_builder *idx,
           // PCRE
           regex *re, regex_storage *mem,
-          // GLOB
-          const char *glob_pattern, int glob_flags,
           // GIT
           shared_ptr repo) {
     // If maximum depth is exceeded we stop
@@ -104,17 +321,128 @@ void walk(const char *parent, const size_t l_parent, const options *const opt,
         return;
     }
 
-    // Traverse the directory
-    size_t cnt = 0, len_names = 16;
-    char **names = (char **)malloc(len_names * sizeof(char *));
-    for (struct dirent *_d = (struct dirent *)opendir(parent), *entry = NULL;
-         (DIR *)_d != NULL
-         && ((entry = readdir((DIR *)_d)) != NULL || closedir((DIR *)_d));) {
-        const char *d_name = entry->d_name;
-        size_t d_namlen = strlen(d_name);
+    // When indexing, remember when the directory was last changed and
+    // which ignore files its listing was filtered with.  If both are
+    // still the same as in the index being updated, take the entries
+    // from there instead of reading the directory.
+    const fileindex_child *children = NULL;
+    size_t nchildren = 0, child = 0;
+    bool reuse = false;
+    uint64_t rules_stamp = 0;
+    if (idx != NULL) {
+        struct stat statbuf;
+        if (fstatat(at != NULL ? at->fd : AT_FDCWD, at != NULL ? name : parent,
+                    &statbuf, 0)
+            != 0) {
+            return;
+        }
+        fileindex_stamp stamp;
+        stamp.mtime = statbuf.st_mtim.tv_sec * 1000000000LL
+                      + statbuf.st_mtim.tv_nsec;
+        stamp.ctime = statbuf.st_ctim.tv_sec * 1000000000LL
+                      + statbuf.st_ctim.tv_nsec;
+        if (!opt->no_ignore) {
+            rules_stamp =
+                at != NULL
+                    ? gitignore_stamp(repo.stamp, at->fd, name,
+                                      l_parent - (size_t)(name - parent))
+                    : gitignore_stamp(repo.stamp, AT_FDCWD, parent, l_parent);
+        }
+        stamp.rules = rules_stamp;
+        fileindex_builder_add_dir(idx, parent, l_parent, &stamp);
+        reuse = opt->previous != NULL
+                && fileindex_dirs_find(opt->previous, parent, l_parent, &stamp,
+                                       &children, &nchildren);
+    }
+
+    // Open the directory relative to its parent if we still hold the
+    // parent's descriptor, otherwise resolve the whole path
+    if (!reuse && !(at != NULL ? dirstream_open(ds, at->fd, name)
+                               : dirstream_open(ds, AT_FDCWD, parent))) {
+        return;
+    }
+
+    // Our own descriptor, once a subdirectory has been found.  There
+    // is none to share if the directory was not opened.
+    dirref *here = NULL;
+    bool here_tried = reuse;
+
+    // Everything that only lives as long as we process this directory
+    // is allocated from the scratch arena which is reset at the end.
+    //
+    // Full paths of the entries are assembled in this buffer and only
+    // copied if they have to outlive the current entry
+    char *current = (char *)arena_alloc(scratch, l_parent + NAME_MAX + 2);
+    memcpy(current, parent, l_parent);
+    current[l_parent] = '/';
+
+    // Read the listing before looking at any entry.  Whether the
+    // directory is the root of a repository or has a .gitignore of its
+    // own is seen from the listing and decides the ignore rules for all
+    // of its entries.
+    size_t nentries = 0, len_entries = 64;
+    dirstream_entry *entries = (dirstream_entry *)arena_alloc(
+        scratch, len_entries * sizeof(dirstream_entry));
+    bool has_git = false, has_gitignore = false;
+    bool more = read_entries(ds, reuse, children, nchildren, &child, opt,
+                             scratch, &entries, &nentries, &len_entries,
+                             &has_git, &has_gitignore);
+
+    // A listing taken over from the index lacks hidden entries if
+    // those were skipped, and a long one has only been read in part, so
+    // the directory has to be probed
+    shared_ptr rules =
+        opt->no_ignore
+            ? make_shared_copy(repo)
+            : ignore_rules(parent, l_parent, repo,
+                           !more && !(reuse && opt->skip_hidden), has_git,
+                           has_gitignore);
+    rules.stamp = rules_stamp;
+
+    // Traverse the directory.  Unless the output is unsorted, the
+    // matches are collected and sorted before printing.
+    size_t cnt = 0, len_names = 16, nresults = 0;
+    match *names = NULL;
+    if (!opt->unsorted) {
+        names = (match *)arena_alloc(scratch, len_names * sizeof(match));
+    }
+    // Directories and regular files are colored by their permission
+    // bits, so their modes are looked up alongside the metadata
+    bool lookup_modes = idx == NULL && opt->colorize;
+    size_t npending = 0, len_pending = 16;
+    const char **pending = NULL;
+    pending_match *pending_matches = NULL;
+    if (idx == NULL && (opt->meta.fields != 0 || lookup_modes)) {
+        pending = (const char **)arena_alloc(
+            scratch, len_pending * sizeof(const char *));
+        pending_matches = (pending_match *)arena_alloc(
+            scratch, len_pending * sizeof(pending_match));
+    }
+    for (size_t i = 0;; ++i) {
+        // Go on with the rest of a long listing
+        if (i == nentries && more) {
+            more = read_entries(ds, reuse, children, nchildren, &child, opt,
+                                scratch, &entries, &nentries, &len_entries,
+                                &has_git, &has_gitignore);
+            i = 0;
+        }
+        if (i == nentries) {
+            break;
+        }
+        dirstream_entry entry = entries[i];
+
+        // Once there are enough results or the time is up, no more
+        // subdirectories are queued
+        if (limiter_stopped(opt->limit)) {
+            break;
+        }
+
+        const char *d_name = entry.name;
+        size_t d_namlen = entry.namlen;
 
         // Skip current and parent
-        if (strcmp(d_name, ".") == 0 || strcmp(d_name, "..") == 0) {
+        if (d_name[0] == '.'
+            && (d_namlen == 1 || (d_namlen == 2 && d_name[1] == '.'))) {
             continue;
         }
 
@@ -126,102 +454,229 @@ void walk(const char *parent, const size_t l_parent, const options *const opt,
 
         // Assemble full filename
         size_t l_current = l_parent + d_namlen + 1;
-        char *current = (char *)malloc((l_current + 1) * sizeof(char));
-        strncpy(current, parent, l_parent);
-        strncpy(current + l_parent, "/", 1);
-        strncpy(current + l_parent + 1, d_name, d_namlen);
+        memcpy(current + l_parent + 1, d_name, d_namlen);
         current[l_current] = '\0';
 
-        // Filter by file extension (only files)
-        if (opt->ext && entry->d_type == DT_REG) {
-            const char *ext = strrchr(d_name, '.');
-            if (ext == NULL || strcmp(ext + 1, opt->ext) != 0) {
-                free(current);
+        // Apply the filters.  Entries which are neither matched nor
+        // traversed need no further attention.  An index records every
+        // entry, the filters are applied when it is queried.
+        size_t tag = 0;
+        bool matched = idx != NULL
+                       || match_entry(current, l_current, d_namlen,
+                                      entry.type, opt, re, mem, &tag);
+        if (!matched && entry.type != DT_DIR) {
+            continue;
+        }
+
+        // Check .gitignore.  Ignored directories are never opened.
+        if (!opt->no_ignore && rules.ptr != NULL) {
+            if (gitignore_is_ignored(rules.ptr, current, l_current,
+                                     entry.type)) {
                 continue;
             }
         }
 
-        // Check .gitignore
-        if (!opt->no_ignore && repo.ptr != NULL) {
-            if (gitignore_is_ignored(repo.ptr, current, l_current,
-                                     entry->d_type)) {
-                free(current);
-                continue;
+        // If the current item is a directory itself, queue it for
+        // traversal
+        if (entry.type == DT_DIR) {
+            // Increment the flagman count
+            flagman_acquire(opt->flagman_lock);
+
+            // The subdirectory works out its own ignore rules on top
+            // of ours once it is read
+            shared_ptr currentrepo = make_shared_copy(rules);
+
+            // Share our descriptor with the subdirectories
+            if (!here_tried) {
+                here = dirref_new(ds, opt->max_open_dirs);
+                here_tried = true;
             }
+
+            // Queue the new item
+            message *m =
+                message_new(message_body_new(depth + 1, l_current, current,
+                                             d_namlen, dirref_copy(here),
+                                             currentrepo),
+                            message_body_free);
+            deque_put(self, m, (size_t)(depth + 1));
+        }
+
+        if (!matched) {
+            continue;
         }
 
-        // Perform the match
-        switch (opt->mode) {
-        case REGEX: {
-            if (regex_match(re, mem, d_name, d_namlen)) {
-                goto success;
+        // The metadata is only looked up for entries which passed all
+        // of the cheaper filters, for all of them at once after the
+        // listing has been gone through
+        if (idx == NULL
+            && (opt->meta.fields != 0
+                || (lookup_modes
+                    && (entry.type == DT_REG || entry.type == DT_DIR
+                        || entry.type == DT_UNKNOWN)))) {
+            if (__builtin_expect(npending == len_pending, 0)) {
+                const char **old_pending = pending;
+                pending_match *old_pending_matches = pending_matches;
+                len_pending *= 2;
+                pending = (const char **)arena_alloc(
+                    scratch, len_pending * sizeof(const char *));
+                pending_matches = (pending_match *)arena_alloc(
+                    scratch, len_pending * sizeof(pending_match));
+                memcpy(pending, old_pending, npending * sizeof(const char *));
+                memcpy(pending_matches, old_pending_matches,
+                       npending * sizeof(pending_match));
             }
-            break;
+            pending[npending] = d_name;
+            pending_matches[npending].namlen = d_namlen;
+            pending_matches[npending].type = entry.type;
+            pending_matches[npending].tag = tag;
+            ++npending;
+            continue;
         }
-        case GLOB:
-            if (fnmatch(glob_pattern, d_name, glob_flags) == 0) {
-                goto success;
+
+        if (idx != NULL) {
+            fileindex_builder_add(idx, current, l_current, entry.type);
+        } else if (opt->unsorted) {
+            process_match(out, current, l_current, parent, l_parent,
+                          current + l_parent + 1, dirstream_fd(ds),
+                          entry.type, 0, tag, opt);
+            ++nresults;
+            if (outbuf_length(out) >= OUTPUT_BATCH_SIZE) {
+                outbuf_flush(out);
             }
-            break;
-        case NONE:
-        success:
-            if (!(opt->ext && entry->d_type == DT_DIR)
-                && (opt->only_type == DT_UNKNOWN
-                    || opt->only_type == entry->d_type)) {
-                if (__builtin_expect(cnt == len_names, 0)) {
-                    len_names *= 2;
-                    names = (char **)realloc(names, len_names * sizeof(char *));
-                }
-                names[cnt++] = current;
+        } else {
+            if (__builtin_expect(cnt == len_names, 0)) {
+                match *old_names = names;
+                len_names *= 2;
+                names = (match *)arena_alloc(scratch,
+                                             len_names * sizeof(match));
+                memcpy(names, old_names, cnt * sizeof(match));
             }
-            break;
+            names[cnt].path = (char *)arena_alloc(scratch, l_current + 1);
+            memcpy(names[cnt].path, current, l_current + 1);
+            names[cnt].len = l_current;
+            names[cnt].type = entry.type;
+            names[cnt].mode = 0;
+            names[cnt].tag = tag;
+            ++cnt;
         }
+    }
 
-        // If the current item is a directory itself, queue it for
-        // traversal
-        if (entry->d_type == DT_DIR) {
-            // Increment the flagman count
-            flagman_acquire(opt->flagman_lock);
-
-            // If this directory is a git repo, open it so we can scan
-            // .gitignore
-            shared_ptr currentrepo = make_shared(NULL);
-            if (!opt->no_ignore) {
-                if ((currentrepo.ptr = gitignore_new(current)) == NULL) {
-                    // We failed, so we have to free the refcnt of NULL
-                    free_shared(currentrepo);
-                    // If it is not a git repo, duplicate the current handle
-                    currentrepo = make_shared_copy(repo);
+    // Look up the metadata of the remaining candidates in one batch
+    if (npending > 0 && !limiter_stopped(opt->limit)) {
+        bool *pass = (bool *)arena_alloc(scratch, npending * sizeof(bool));
+        unsigned *modes = NULL;
+        if (lookup_modes) {
+            modes =
+                (unsigned *)arena_alloc(scratch, npending * sizeof(unsigned));
+        }
+        match_metadata_batch(sb, dirstream_fd(ds), pending, npending, pass,
+                             modes, opt);
+        for (size_t i = 0; i < npending; ++i) {
+            if (!pass[i]) {
+                continue;
+            }
+            const pending_match *pm = &pending_matches[i];
+            size_t l_current = l_parent + pm->namlen + 1;
+            memcpy(current + l_parent + 1, pending[i], pm->namlen);
+            current[l_current] = '\0';
+            unsigned mode = modes != NULL ? modes[i] : 0;
+            if (opt->unsorted) {
+                process_match(out, current, l_current, parent, l_parent,
+                              current + l_parent + 1, dirstream_fd(ds),
+                              pm->type, mode, pm->tag, opt);
+                ++nresults;
+                if (outbuf_length(out) >= OUTPUT_BATCH_SIZE) {
+                    outbuf_flush(out);
+                }
+            } else {
+                if (__builtin_expect(cnt == len_names, 0)) {
+                    match *old_names = names;
+                    len_names *= 2;
+                    names = (match *)arena_alloc(scratch,
+                                                 len_names * sizeof(match));
+                    memcpy(names, old_names, cnt * sizeof(match));
                 }
+                names[cnt].path = (char *)arena_alloc(scratch, l_current + 1);
+                memcpy(names[cnt].path, current, l_current + 1);
+                names[cnt].len = l_current;
+                names[cnt].type = pm->type;
+                names[cnt].mode = mode;
+                names[cnt].tag = pm->tag;
+                ++cnt;
             }
-
-            // Queue the new item
-            message *m = message_new(
-                message_body_new(depth + 1, l_current, current, currentrepo),
-                message_body_free);
-            queue_put(opt->q, m, depth + 1);
         }
     }
 
-    qsort(names, cnt, sizeof(char *), cmp);
+    // The directory stays open until the results are printed, so the
+    // colors can be looked up relative to it
+    match **sorted = NULL;
+    if (cnt > 0) {
+        sorted = (match **)arena_alloc(scratch, cnt * sizeof(match *));
+        for (size_t i = 0; i < cnt; ++i) {
+            sorted[i] = &names[i];
+        }
+    }
+    if (cnt > 1) {
+        qsort(sorted, cnt, sizeof(match *), cmp);
+    }
     for (size_t i = 0; i < cnt; ++i) {
-        const char *d_name = strrchr(names[i], '/') + 1;
-        process_match(names[i], parent, d_name, opt);
-        free(names[i]);
+        const match *m = sorted[i];
+        const char *d_name = m->path + l_parent + 1;
+        process_match(out, m->path, m->len, parent, l_parent, d_name,
+                      dirstream_fd(ds), m->type, m->mode, m->tag, opt);
+    }
+    nresults += cnt;
+    dirstream_close(ds);
+    dirref_free(here);
+    free_shared(rules);
+    arena_reset(scratch);
+
+    // The hybrid schedule turns to the deep directories once enough
+    // results are out.  They are counted once per directory to keep
+    // the workers from contending for the counter.
+    if (opt->schedule == SCHEDULE_HYBRID && nresults > 0
+        && queue_get_order(opt->q) == QUEUE_SHALLOW_FIRST
+        && __atomic_add_fetch(&results_count, nresults, __ATOMIC_RELAXED)
+               >= opt->schedule_results) {
+        queue_set_order(opt->q, QUEUE_DEEP_FIRST);
+    }
+
+    // Write out the results in one go
+    if (opt->line_buffered || outbuf_length(out) >= OUTPUT_BATCH_SIZE) {
+        outbuf_flush(out);
     }
-    free(names);
 }
 
 static void *worker(void *arg) {
     const options *const opt = (options *)arg;
 
-    // Assemble some thread-local storage, such as JIT stack for PCRE
-    // or options for globbing
+    // Claim our own deque of the message queue
+    deque *self = queue_attach(opt->q);
+
+    // Assemble some thread-local storage, such as JIT stack for PCRE.
+    // A compiled glob is shared by all threads.
     regex *re = NULL;
     regex_storage *mem = NULL;
 
-    const char *glob_pattern = NULL;
-    int glob_flags = 0;
+    dirstream *ds = dirstream_new();
+    outbuf *out = outbuf_new(fileno(stdout));
+
+    // The metadata filters and the colors look up whole directories at
+    // once if the kernel offers io_uring
+    statx_batch *sb = NULL;
+    if (opt->meta.fields != 0 || opt->colorize) {
+        sb = statx_batch_new();
+    }
+    arena *scratch = arena_new(SCRATCH_BLOCK_SIZE);
+
+    // When building an index or starting the daemon, the results are
+    // collected instead of printed and handed back to main when the
+    // thread exits
+    fileindex_builder *idx = NULL;
+    if (opt->index == INDEX_BUILD || opt->index == INDEX_UPDATE
+        || opt->daemon == DAEMON_SERVE) {
+        idx = fileindex_builder_new();
+    }
 
     switch (opt->mode) {
     case REGEX:
@@ -229,8 +684,6 @@ static void *worker(void *arg) {
         mem = regex_storage_new(re);
         break;
     case GLOB:
-        glob_pattern = opt->match.pattern;
-        glob_flags = opt->icase ? FNM_CASEFOLD : 0;
         break;
     case NONE:
         break;
@@ -240,24 +693,33 @@ static void *worker(void *arg) {
     //
     // Each message in the queue is a directory, so we fetch one
     // message from the queue and walk the directory tree.
-    for (message *msg = NULL; (msg = queue_get(opt->q)) != NULL;
+    for (message *msg = NULL; (msg = deque_get(self)) != NULL;
          message_free(msg)) {
         // Dissect the message
         message_body *b = (message_body *)message_data(msg);
         int depth = b->depth;
         size_t l_parent = b->len;
         const char *parent = b->str;
+        const char *name = parent + l_parent - b->namelen;
+        dirref *at = b->at;
         shared_ptr repo = b->repo;
 
-        // Walk the directory tree
-        walk(parent, l_parent, opt, depth, re, mem, glob_pattern, glob_flags,
-             repo);
+        // Walk the directory tree.  After a limit has been reached, the
+        // queue is drained without opening the remaining directories.
+        if (!limiter_stopped(opt->limit)) {
+            walk(parent, l_parent, opt, depth, self, at, name, ds, sb, out,
+                 scratch, idx, re, mem, repo);
+        }
 
         // We are finished, so we can decrement the flagman count
         flagman_release(opt->flagman_lock);
     }
 
     // Cleanup the thread-local state
+    dirstream_free(ds);
+    statx_batch_free(sb);
+    outbuf_free(out);
+    arena_free(scratch);
     switch (opt->mode) {
     case REGEX:
         regex_storage_free(mem);
@@ -268,24 +730,156 @@ static void *worker(void *arg) {
         break;
     }
 
+    return idx;
+}
+
+typedef struct {
+    const options *opt;
+    fileindex *ix;
+    size_t next_block;
+} index_query;
+
+static void *index_worker(void *arg) {
+    index_query *iq = (index_query *)arg;
+    const options *const opt = iq->opt;
+
+    regex *re = NULL;
+    regex_storage *mem = NULL;
+
+    fileindex_cursor *c = fileindex_cursor_new(iq->ix);
+    outbuf *out = outbuf_new(fileno(stdout));
+
+    switch (opt->mode) {
+    case REGEX:
+        re = opt->match.re;
+        mem = regex_storage_new(re);
+        break;
+    case GLOB:
+        break;
+    case NONE:
+        break;
+    }
+
+    // Every thread grabs blocks of the index until all are done
+    size_t nblocks = fileindex_blocks(iq->ix);
+    for (size_t block = 0;
+         !limiter_stopped(opt->limit)
+         && (block = __atomic_fetch_add(&iq->next_block, 1, __ATOMIC_SEQ_CST))
+                < nblocks;) {
+        fileindex_cursor_seek(c, block);
+
+        const char *path;
+        size_t len;
+        unsigned char type;
+        while (!limiter_stopped(opt->limit)
+               && fileindex_cursor_next(c, &path, &len, &type)) {
+            const char *d_name = strrchr(path, '/');
+            d_name = d_name != NULL ? d_name + 1 : path;
+            size_t d_namlen = len - (size_t)(d_name - path);
+
+            // The mode looked up for the metadata filters also gives
+            // the color
+            size_t tag;
+            unsigned mode = 0;
+            if (match_entry(path, len, d_namlen, type, opt, re, mem, &tag)
+                && (opt->meta.fields == 0
+                    || match_metadata(AT_FDCWD, path,
+                                      opt->colorize ? &mode : NULL, opt))) {
+                print_path(out, path, len, type, mode, tag, opt);
+            }
+        }
+
+        if (opt->line_buffered || outbuf_length(out) >= OUTPUT_BATCH_SIZE) {
+            outbuf_flush(out);
+        }
+    }
+
+    // Cleanup the thread-local state
+    outbuf_free(out);
+    fileindex_cursor_free(c);
+    if (opt->mode == REGEX) {
+        regex_storage_free(mem);
+    }
+
     return NULL;
 }
 
+static int query_index(const options *const opt) {
+    index_query iq;
+    iq.opt = opt;
+    iq.next_block = 0;
+    if ((iq.ix = fileindex_open(opt->index_file)) == NULL) {
+        return 1;
+    }
+
+    pthread_t *thread = (pthread_t *)malloc(opt->nthreads * sizeof(pthread_t));
+    for (int i = 0; i < opt->nthreads; ++i) {
+        pthread_create(&thread[i], NULL, &index_worker, &iq);
+    }
+    for (int i = 0; i < opt->nthreads; ++i) {
+        pthread_join(thread[i], NULL);
+    }
+
+    free(thread);
+    fileindex_close(iq.ix);
+    return 0;
+}
+
+// Wait for the commands run for the results, returning 1 if any of
+// them failed
+static int finish_exec(options *opt) {
+    if (opt->exec == NULL) {
+        return 0;
+    }
+    int ret = exec_pool_finish(opt->exec);
+    exec_pool_free(opt->exec);
+    free(opt->exec_argv);
+    return ret;
+}
+
 int main(int argc, char *argv[]) {
     options opt;
 
     // Defaults
     opt.mode = NONE;
+    opt.patterns = NULL;
+    opt.npatterns = 0;
     opt.only_type = DT_UNKNOWN;
+    opt.meta.fields = 0;
+    opt.meta.min_size = LLONG_MIN;
+    opt.meta.max_size = LLONG_MAX;
+    opt.meta.min_mtime = LLONG_MIN;
+    opt.meta.max_mtime = LLONG_MAX;
+    opt.meta.uid = -1;
+    opt.meta.gid = -1;
+    opt.meta.perm = 0;
+    opt.meta.perm_match = '=';
     opt.skip_hidden = true;
     opt.max_depth = -1;
     opt.colorize = isatty(fileno(stdout));
+    opt.line_buffered = isatty(fileno(stdout));
     opt.icase = false;
     opt.no_ignore = false;
     opt.nthreads = get_nprocs();
     opt.ext = NULL;
     opt.delimiter = '\n';
     opt.absolute = false;
+    opt.unsorted = false;
+    opt.tag = false;
+    opt.index = INDEX_NONE;
+    opt.index_file = NULL;
+    opt.previous = NULL;
+    opt.daemon = DAEMON_NONE;
+    opt.socket_path = NULL;
+    opt.exec_argv = NULL;
+    opt.exec_argc = 0;
+    opt.exec_batch = false;
+    opt.exec = NULL;
+    opt.max_results = 0;
+    opt.timeout = 0;
+    opt.limit = NULL;
+    opt.schedule = SCHEDULE_DEEP;
+    opt.schedule_results = 100;
 
     // Parse the command line
     switch (ff_parse_options(argc, argv, &opt)) {
@@ -297,10 +891,103 @@ int main(int argc, char *argv[]) {
         return 0;
     }
 
+    // The results are handed to the command instead of printed, which
+    // runs in child processes alongside the search
+    if (opt.exec_argv != NULL) {
+        opt.colorize = false;
+        opt.exec = exec_pool_new(opt.exec_argv, opt.exec_argc,
+                                 opt.exec_batch, opt.nthreads);
+    }
+
+    // The clock for --timeout starts once the options are read
+    if (opt.max_results > 0 || opt.timeout > 0) {
+        opt.limit = limiter_new(opt.max_results, opt.timeout);
+    }
+
+    // Answer the query from the index or the daemon instead of the
+    // file system.  If the daemon does not have what the traversal
+    // options ask for, the paths it watches are searched directly.
+    const char **fallback = NULL;
+    size_t nfallback = 0;
+    if (opt.index == INDEX_QUERY || opt.daemon == DAEMON_CONNECT) {
+        int ret = opt.daemon == DAEMON_CONNECT
+                      ? daemon_query(&opt, &fallback, &nfallback)
+                      : query_index(&opt);
+        if (ret != DAEMON_REFUSED) {
+            if (finish_exec(&opt) != 0) {
+                ret = 1;
+            }
+            limiter_free(opt.limit);
+            if (opt.mode == REGEX) {
+                regex_free(opt.match.re);
+            } else if (opt.mode == GLOB) {
+                glob_free(opt.match.gl);
+            }
+            free(opt.patterns);
+            return ret;
+        }
+        opt.daemon = DAEMON_NONE;
+    }
+
+    // An index being updated is refreshed with the options it was built
+    // with, and the directories which did not change are taken from it
+    fileindex *previous = NULL;
+    fileindex_info info;
+    info.flags = 0;
+    info.max_depth = -1;
+    info.nroots = 0;
+    info.roots = NULL;
+    if (opt.index == INDEX_UPDATE) {
+        if ((previous = fileindex_open(opt.index_file)) == NULL) {
+            return 1;
+        }
+        fileindex_get_info(previous, &info);
+        opt.skip_hidden = (info.flags & INDEX_HIDDEN) == 0;
+        opt.no_ignore = (info.flags & INDEX_NO_IGNORE) != 0;
+        opt.max_depth = info.max_depth;
+        opt.absolute = false;
+        opt.previous = fileindex_dirs_load(previous);
+    } else if (opt.index == INDEX_BUILD) {
+        info.flags = (opt.skip_hidden ? 0 : INDEX_HIDDEN)
+                     | (opt.no_ignore ? INDEX_NO_IGNORE : 0);
+        info.max_depth = opt.max_depth;
+    }
+
+    // The daemon is asked from any directory, so it watches its roots
+    // by their full paths
+    if (opt.daemon == DAEMON_SERVE) {
+        opt.absolute = true;
+    }
+
+    // The results are sorted as a whole, so don't bother sorting every
+    // directory
+    if (opt.index == INDEX_BUILD || opt.index == INDEX_UPDATE
+        || opt.daemon == DAEMON_SERVE) {
+        opt.colorize = false;
+        opt.unsorted = true;
+    }
+
+    // Keep at most half of the available file descriptors open for
+    // opening subdirectories relative to their parent
+    struct rlimit rl;
+    opt.max_open_dirs = 0;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        opt.max_open_dirs = rl.rlim_cur == RLIM_INFINITY
+                                ? 65536
+                                : (long)rl.rlim_cur / 2 - opt.nthreads;
+    }
+
     gitignore_init_global();
+    message_init_global();
+    dirref_pool = pool_new(sizeof(dirref));
+    message_body_pool = pool_new(sizeof(message_body));
+    shared_pool = pool_new(sizeof(shared_block));
 
     // Open a new message queue
-    opt.q = queue_new();
+    opt.q = queue_new(opt.nthreads);
+    queue_set_order(opt.q, opt.schedule == SCHEDULE_DEEP
+                               ? QUEUE_DEEP_FIRST
+                               : QUEUE_SHALLOW_FIRST);
 
     // Acquire the flagman lock
     opt.flagman_lock = flagman_new();
@@ -312,58 +999,102 @@ int main(int argc, char *argv[]) {
         pthread_create(&thread[i], NULL, &worker, &opt);
     }
 
-    // Send the inital job
-    if (opt.optind == argc) {
-        char *path = strdup(".");
-        if (opt.absolute) {
-            path = realpath(path, NULL);
-        }
-        shared_ptr repo = make_shared(NULL);
-        if (!opt.no_ignore) {
-            repo.ptr = gitignore_new(path);
-        }
-        message *msg = message_new(
-            message_body_new(0, strlen(path), path, repo), message_body_free);
-        queue_put_head(opt.q, msg);
-        free(path);
+    // Send the inital jobs
+    if (fallback != NULL) {
+        info.nroots = nfallback;
+        info.roots = fallback;
+    } else if (opt.index != INDEX_UPDATE) {
+        static const char *cwd[] = {"."};
+        info.nroots =
+            opt.optind == opt.argc ? 1 : (size_t)(opt.argc - opt.optind);
+        info.roots = opt.optind == opt.argc
+                         ? cwd
+                         : (const char **)argv + opt.optind;
     }
-
-    for (int arg = opt.optind; arg < argc; ++arg) {
-        char *path = argv[arg];
-        if (opt.absolute) {
-            path = realpath(path, NULL);
+    const char **roots =
+        (const char **)malloc((info.nroots + 1) * sizeof(char *));
+    size_t nroots = 0;
+    for (size_t i = 0; i < info.nroots; ++i) {
+        char *path = opt.absolute ? realpath(info.roots[i], NULL)
+                                  : strdup(info.roots[i]);
+        if (path == NULL) {
+            perror(info.roots[i]);
+            continue;
         }
+        roots[nroots++] = path;
         shared_ptr repo = make_shared(NULL);
-        if (!opt.no_ignore) {
-            repo.ptr = gitignore_new(path);
-        }
-        message *msg = message_new(
-            message_body_new(0, strlen(path), path, repo), message_body_free);
+        size_t len = strlen(path);
+        message *msg =
+            message_new(message_body_new(0, len, path, len, NULL, repo),
+                        message_body_free);
         queue_put_head(opt.q, msg);
-        if (opt.absolute) {
-            free(path);
-        }
     }
 
     // Send termination signal
     flagman_wait(opt.flagman_lock);
+    queue_close(opt.q);
+
+    fileindex_builder **idx = (fileindex_builder **)malloc(
+        opt.nthreads * sizeof(fileindex_builder *));
     for (int i = 0; i < opt.nthreads; ++i) {
-        queue_put_tail(opt.q, NULL);
+        pthread_join(thread[i], (void **)&idx[i]);
     }
 
-    for (int i = 0; i < opt.nthreads; ++i) {
-        pthread_join(thread[i], NULL);
+    // Write the collected results
+    int ret = 0;
+    if (opt.index == INDEX_BUILD || opt.index == INDEX_UPDATE) {
+        fileindex_info written = info;
+        written.nroots = nroots;
+        written.roots = roots;
+        if (!fileindex_write(opt.index_file, idx, opt.nthreads, &written)) {
+            ret = 1;
+        }
+        for (int i = 0; i < opt.nthreads; ++i) {
+            fileindex_builder_free(idx[i]);
+        }
+    }
+
+    // Hand the collected results over to the daemon, which keeps them
+    // current until it is stopped
+    if (opt.daemon == DAEMON_SERVE) {
+        ret = daemon_serve(&opt, idx, opt.nthreads, roots, nroots);
+        for (int i = 0; i < opt.nthreads; ++i) {
+            fileindex_builder_free(idx[i]);
+        }
+    }
+    free(idx);
+    if (finish_exec(&opt) != 0) {
+        ret = 1;
+    }
+
+    for (size_t i = 0; i < nroots; ++i) {
+        free((char *)roots[i]);
+    }
+    free(roots);
+    free(fallback);
+    if (previous != NULL) {
+        free(info.roots);
+        fileindex_dirs_free(opt.previous);
+        fileindex_close(previous);
     }
 
     // Cleanup memory
     if (opt.mode == REGEX) {
         regex_free(opt.match.re);
+    } else if (opt.mode == GLOB) {
+        glob_free(opt.match.gl);
     }
+    free(opt.patterns);
 
     free(thread);
+    limiter_free(opt.limit);
     flagman_free(opt.flagman_lock);
     queue_free(opt.q);
     gitignore_free_global();
+    pool_free(shared_pool);
+    pool_free(message_body_pool);
+    pool_free(dirref_pool);
+    message_free_global();
 
-    return 0;
+    return ret;
 }
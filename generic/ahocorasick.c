@@ -0,0 +1,152 @@
+#include "ahocorasick.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Search for several needles at once
+//
+// The needles are compiled into a deterministic automaton (Aho-Corasick)
+// which reads every byte of the haystack exactly once.  Bytes which
+// occur in none of the needles share a single column of the transition
+// table, which keeps the table small enough to stay in cache.
+//
+// A case-insensitive automaton folds ASCII letters only, so like substr
+// it gives up on haystacks which are not ASCII.
+
+struct _ahocorasick {
+    // column of the transition table for every byte
+    uint16_t column[256];
+    size_t ncolumns;
+    // transition table, one row per state, state 0 is the root
+    int32_t *next;
+    // lowest numbered needle ending in the state, or AHOCORASICK_NONE
+    int32_t *found;
+    bool icase;
+};
+
+static unsigned char fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static int32_t lowest(int32_t a, int32_t b) {
+    if (a == AHOCORASICK_NONE) {
+        return b;
+    }
+    if (b == AHOCORASICK_NONE) {
+        return a;
+    }
+    return a < b ? a : b;
+}
+
+ahocorasick *ahocorasick_new(const char *const *needles, size_t n,
+                             bool icase) {
+    ahocorasick *ac = (ahocorasick *)malloc(sizeof(ahocorasick));
+    ac->icase = icase;
+
+    // Number the bytes of the needles
+    memset(ac->column, 0, sizeof(ac->column));
+    ac->ncolumns = 1;
+    size_t nstates = 1;
+    for (size_t i = 0; i < n; ++i) {
+        for (const char *p = needles[i]; *p != '\0'; ++p) {
+            unsigned char c = (unsigned char)*p;
+            c = icase ? fold(c) : c;
+            if (ac->column[c] == 0) {
+                ac->column[c] = (uint16_t)ac->ncolumns++;
+            }
+            ++nstates;
+        }
+    }
+    if (icase) {
+        for (unsigned c = 'A'; c <= 'Z'; ++c) {
+            ac->column[c] = ac->column[c | 0x20];
+        }
+    }
+
+    // Build the trie of the needles.  Missing transitions are -1 for now.
+    const size_t w = ac->ncolumns;
+    ac->next = (int32_t *)malloc(nstates * w * sizeof(int32_t));
+    ac->found = (int32_t *)malloc(nstates * sizeof(int32_t));
+    for (size_t i = 0; i < nstates * w; ++i) {
+        ac->next[i] = -1;
+    }
+    for (size_t i = 0; i < nstates; ++i) {
+        ac->found[i] = AHOCORASICK_NONE;
+    }
+    int32_t used = 1;
+    for (size_t i = 0; i < n; ++i) {
+        int32_t s = 0;
+        for (const char *p = needles[i]; *p != '\0'; ++p) {
+            int32_t *t = &ac->next[(size_t)s * w
+                                   + ac->column[(unsigned char)*p]];
+            if (*t < 0) {
+                *t = used++;
+            }
+            s = *t;
+        }
+        ac->found[s] = lowest(ac->found[s], (int32_t)i);
+    }
+
+    // Turn the trie into an automaton in breadth-first order, so that
+    // the failure state of every state is complete when it is reached
+    int32_t *fail = (int32_t *)malloc((size_t)used * sizeof(int32_t));
+    int32_t *order = (int32_t *)malloc((size_t)used * sizeof(int32_t));
+    size_t head = 0, tail = 0;
+    for (size_t k = 0; k < w; ++k) {
+        int32_t *t = &ac->next[k];
+        if (*t < 0) {
+            *t = 0;
+        } else {
+            fail[*t] = 0;
+            order[tail++] = *t;
+        }
+    }
+    while (head < tail) {
+        int32_t r = order[head++];
+        for (size_t k = 0; k < w; ++k) {
+            int32_t *t = &ac->next[(size_t)r * w + k];
+            int32_t f = ac->next[(size_t)fail[r] * w + k];
+            if (*t < 0) {
+                *t = f;
+            } else {
+                fail[*t] = f;
+                ac->found[*t] = lowest(ac->found[*t], ac->found[f]);
+                order[tail++] = *t;
+            }
+        }
+    }
+    free(order);
+    free(fail);
+
+    return ac;
+}
+
+void ahocorasick_free(ahocorasick *ac) {
+    if (ac == NULL) {
+        return;
+    }
+    free(ac->found);
+    free(ac->next);
+    free(ac);
+    ac = NULL;
+}
+
+// Returns the lowest numbered needle found in the haystack, or
+// AHOCORASICK_NONE.  A case-insensitive search returns
+// AHOCORASICK_NOT_ASCII if the haystack is not ASCII.
+int ahocorasick_search(const ahocorasick *ac, const char *str, size_t len) {
+    const size_t w = ac->ncolumns;
+    int32_t s = 0, best = AHOCORASICK_NONE;
+    for (size_t i = 0; i < len; ++i) {
+        unsigned char c = (unsigned char)str[i];
+        if (ac->icase && (c & 0x80)) {
+            return AHOCORASICK_NOT_ASCII;
+        }
+        s = ac->next[(size_t)s * w + ac->column[c]];
+        best = lowest(best, ac->found[s]);
+    }
+    return best;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _ahocorasick ahocorasick;
+
+enum {
+    AHOCORASICK_NONE = -1,
+    AHOCORASICK_NOT_ASCII = -2,
+};
+
+ahocorasick *ahocorasick_new(const char *const *needles, size_t n,
+                             bool icase);
+void ahocorasick_free(ahocorasick *ac);
+int ahocorasick_search(const ahocorasick *ac, const char *str, size_t len);
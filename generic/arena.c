@@ -0,0 +1,81 @@
+#include "arena.h"
+
+// C standard library
+#include <stdlib.h>
+
+// Bump allocator
+//
+// Memory is handed out from a chain of large blocks and released all
+// at once by arena_reset.  The blocks are kept for reuse, so once an
+// arena has grown to the size needed by its owner, allocating from it
+// does not touch the heap anymore.
+
+#define ARENA_ALIGN 16
+
+typedef struct _block block;
+struct _block {
+    block *next;
+    size_t size;
+    char *data;
+};
+
+struct _arena {
+    block *head;
+    block *cur;
+    size_t pos;
+    size_t blocksize;
+};
+
+static block *block_new(size_t size) {
+    block *b = (block *)malloc(sizeof(block));
+    b->next = NULL;
+    b->size = size;
+    b->data = (char *)malloc(size * sizeof(char));
+    return b;
+}
+
+arena *arena_new(size_t blocksize) {
+    arena *a = (arena *)malloc(sizeof(arena));
+    a->head = block_new(blocksize);
+    a->cur = a->head;
+    a->pos = 0;
+    a->blocksize = blocksize;
+    return a;
+}
+
+void arena_free(arena *a) {
+    if (a == NULL) {
+        return;
+    }
+    for (block *b = a->head, *next = NULL; b != NULL; b = next) {
+        next = b->next;
+        free(b->data);
+        free(b);
+    }
+    free(a);
+    a = NULL;
+}
+
+void *arena_alloc(arena *a, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    // Move on to the next block which is large enough, allocating a
+    // new one at the end of the chain if there is none
+    while (__builtin_expect(a->pos + size > a->cur->size, 0)) {
+        if (a->cur->next == NULL) {
+            a->cur->next =
+                block_new(size > a->blocksize ? size : a->blocksize);
+        }
+        a->cur = a->cur->next;
+        a->pos = 0;
+    }
+
+    void *ptr = a->cur->data + a->pos;
+    a->pos += size;
+    return ptr;
+}
+
+void arena_reset(arena *a) {
+    a->cur = a->head;
+    a->pos = 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// C standard library
+#include <stddef.h>
+
+typedef struct _arena arena;
+
+arena *arena_new(size_t blocksize);
+void arena_free(arena *a);
+void *arena_alloc(arena *a, size_t size);
+void arena_reset(arena *a);
@@ -6,6 +6,8 @@
 #include <string.h>
 
 // POSIX C library
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 // Simple hash function for short strings
@@ -33,7 +35,7 @@
                sentinel)
 
 unsigned long hash(const char *str) {
-    if (strlen(str) <= sizeof(unsigned long)) {
+    if (strlen(str) > sizeof(unsigned long)) {
         return 0UL;
     }
     unsigned long hash = 0UL;
@@ -65,20 +67,44 @@ const char *unhash(unsigned long hash) {
 // Copyright (C) 1996-2019 Free Software Foundation, Inc.
 // Copying and distribution of this file, with or without modification,
 // are permitted provided the copyright notice and this notice are preserved.
-const char *dircolor(const char *realpath) {
+//
+// The type of the file is taken from the directory entry, so only
+// directories and regular files, whose color depends on the
+// permission bits, have to be looked up relative to the directory.
+const char *dircolor(int dirfd, const char *name, unsigned char type) {
+    switch (type) {
+    case DT_BLK:
+        return DIRCOLOR_BLK;
+    case DT_CHR:
+        return DIRCOLOR_CHR;
+    case DT_FIFO:
+        return DIRCOLOR_FIFO;
+    case DT_LNK:
+        return DIRCOLOR_LINK;
+    case DT_SOCK:
+        return DIRCOLOR_SOCK;
+    default:
+        break;
+    }
+
     struct stat statbuf;
-    if (lstat(realpath, &statbuf) != 0) {
-        perror("lstat failed");
+    if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+        perror("fstatat failed");
         return "";
     }
+    return dircolor_mode(name, statbuf.st_mode);
+}
 
-    switch (statbuf.st_mode & S_IFMT) {
+// The color of an entry whose mode is already known, e.g. from the
+// metadata looked up for a whole directory at once
+const char *dircolor_mode(const char *name, unsigned mode) {
+    switch (mode & S_IFMT) {
     case S_IFBLK:
         return DIRCOLOR_BLK;
     case S_IFCHR:
         return DIRCOLOR_CHR;
     case S_IFDIR:
-        switch (statbuf.st_mode & (S_ISVTX | S_IWOTH)) {
+        switch (mode & (S_ISVTX | S_IWOTH)) {
         case S_ISVTX | S_IWOTH:
             return DIRCOLOR_STICKY_OTHER_WRITABLE;
         case S_IWOTH:
@@ -95,13 +121,13 @@ const char *dircolor(const char *realpath) {
     case S_IFSOCK:
         return DIRCOLOR_SOCK;
     case S_IFREG:
-        if (statbuf.st_mode & S_ISUID) {
+        if (mode & S_ISUID) {
             return DIRCOLOR_SETUID;
         }
-        if (statbuf.st_mode & S_ISGID) {
+        if (mode & S_ISGID) {
             return DIRCOLOR_SETGID;
         }
-        if (statbuf.st_mode & S_IEXEC) {
+        if (mode & S_IEXEC) {
             return DIRCOLOR_EXEC;
         }
         break;
@@ -110,9 +136,9 @@ const char *dircolor(const char *realpath) {
     }
 
     // Extract the extension
-    const char *basename = strrchr(realpath, '/');
+    const char *basename = strrchr(name, '/');
     if (basename == NULL) {
-        basename = realpath;
+        basename = name;
     }
     const char *ext = strrchr(basename, '.');
     ext = ext ? ext + 1 : "";
@@ -29,4 +29,5 @@
 #define DIRCOLOR_IMAGE "\33[01;35m"
 #define DIRCOLOR_AUDIO "\33[00;36m"
 
-const char *dircolor(const char *ext);
+const char *dircolor(int dirfd, const char *name, unsigned char type);
+const char *dircolor_mode(const char *name, unsigned mode);
@@ -0,0 +1,160 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "dirstream.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// On Linux we bypass readdir and fetch the raw kernel records with
+// getdents64.  The records are read into a large buffer which is
+// reused for every directory a thread visits and the length of each
+// name is derived from the record length instead of calling strlen.
+// Define USE_READDIR to fall back to the portable readdir interface.
+#if defined(__linux__) && !defined(USE_READDIR)
+#define USE_GETDENTS
+#include <sys/syscall.h>
+#endif
+
+#ifdef USE_GETDENTS
+#define DIRSTREAM_BUFSIZE (256 * 1024)
+#endif
+
+struct _dirstream {
+#ifdef USE_GETDENTS
+    int fd;
+    bool owner;
+    char *buf;
+    size_t len;
+    size_t pos;
+#else
+    DIR *dir;
+#endif
+};
+
+dirstream *dirstream_new() {
+    dirstream *ds = (dirstream *)malloc(sizeof(dirstream));
+#ifdef USE_GETDENTS
+    ds->fd = -1;
+    ds->owner = false;
+    ds->buf = (char *)malloc(DIRSTREAM_BUFSIZE * sizeof(char));
+    ds->len = 0;
+    ds->pos = 0;
+#else
+    ds->dir = NULL;
+#endif
+    return ds;
+}
+
+void dirstream_free(dirstream *ds) {
+    if (ds == NULL) {
+        return;
+    }
+    dirstream_close(ds);
+#ifdef USE_GETDENTS
+    free(ds->buf);
+#endif
+    free(ds);
+    ds = NULL;
+}
+
+// The path is resolved relative to the directory dirfd, which may be
+// AT_FDCWD, as for openat
+bool dirstream_open(dirstream *ds, int dirfd, const char *path) {
+    int fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#ifdef USE_GETDENTS
+    ds->fd = fd;
+    ds->owner = true;
+    ds->len = 0;
+    ds->pos = 0;
+    return ds->fd >= 0;
+#else
+    if (fd < 0) {
+        return false;
+    }
+    if ((ds->dir = fdopendir(fd)) == NULL) {
+        close(fd);
+        return false;
+    }
+    return true;
+#endif
+}
+
+bool dirstream_read(dirstream *ds, dirstream_entry *entry) {
+#ifdef USE_GETDENTS
+    if (ds->pos >= ds->len) {
+        long nread = syscall(SYS_getdents64, ds->fd, ds->buf, DIRSTREAM_BUFSIZE);
+        if (nread <= 0) {
+            return false;
+        }
+        ds->len = (size_t)nread;
+        ds->pos = 0;
+    }
+
+    struct dirent64 *d = (struct dirent64 *)(ds->buf + ds->pos);
+    ds->pos += d->d_reclen;
+
+    // The record is padded to an 8 byte boundary after the
+    // terminating NUL of the name, so the name ends somewhere within
+    // the last 8 bytes of the record
+    size_t namlen = d->d_reclen - offsetof(struct dirent64, d_name);
+    size_t skip = namlen > 8 ? namlen - 8 : 0;
+    namlen = skip + strnlen(d->d_name + skip, namlen - skip);
+
+    entry->name = d->d_name;
+    entry->namlen = namlen;
+    entry->type = d->d_type;
+    return true;
+#else
+    struct dirent *d = readdir(ds->dir);
+    if (d == NULL) {
+        return false;
+    }
+    entry->name = d->d_name;
+    entry->namlen = strlen(d->d_name);
+    entry->type = d->d_type;
+    return true;
+#endif
+}
+
+int dirstream_fd(dirstream *ds) {
+#ifdef USE_GETDENTS
+    return ds->fd;
+#else
+    return dirfd(ds->dir);
+#endif
+}
+
+// Hand out a descriptor of the open directory which stays valid
+// after dirstream_close and has to be closed by the caller
+int dirstream_detach(dirstream *ds) {
+#ifdef USE_GETDENTS
+    ds->owner = false;
+    return ds->fd;
+#else
+    return fcntl(dirfd(ds->dir), F_DUPFD_CLOEXEC, 0);
+#endif
+}
+
+void dirstream_close(dirstream *ds) {
+#ifdef USE_GETDENTS
+    if (ds->fd >= 0 && ds->owner) {
+        close(ds->fd);
+    }
+    ds->fd = -1;
+#else
+    if (ds->dir != NULL) {
+        closedir(ds->dir);
+        ds->dir = NULL;
+    }
+#endif
+}
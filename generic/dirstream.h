@@ -0,0 +1,21 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _dirstream dirstream;
+
+typedef struct {
+    const char *name;
+    size_t namlen;
+    unsigned char type;
+} dirstream_entry;
+
+dirstream *dirstream_new();
+void dirstream_free(dirstream *ds);
+bool dirstream_open(dirstream *ds, int dirfd, const char *path);
+bool dirstream_read(dirstream *ds, dirstream_entry *entry);
+int dirstream_fd(dirstream *ds);
+int dirstream_detach(dirstream *ds);
+void dirstream_close(dirstream *ds);
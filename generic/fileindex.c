@@ -0,0 +1,747 @@
+#include "fileindex.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// On-disk filename index
+//
+// The index is a flat file which is mapped into memory as a whole.
+// It starts with a header, followed by the offsets of the blocks, one
+// byte per entry holding its d_type, the front-coded paths, the
+// directories which were read together with their stamps, and the
+// roots of the traversal.
+//
+// The paths are sorted and every path is stored as the length of the
+// prefix it shares with the previous one, the length of the remaining
+// suffix (both as LEB128 varints) and the suffix itself.  Every block
+// of FILEINDEX_BLOCK entries starts over with a full path, so the
+// blocks can be decoded independently and thus in parallel.  The
+// directories are front-coded the same way, but in a single run, with
+// the stamp following each path.
+//
+// All numbers are stored in host byte order, so an index can not be
+// moved between machines of different endianness.
+
+#define FILEINDEX_MAGIC "ffindex\3"
+#define FILEINDEX_BLOCK 256
+
+typedef struct {
+    char magic[8];
+    uint64_t count;
+    uint64_t nblocks;
+    uint64_t blocks_off;
+    uint64_t types_off;
+    uint64_t data_off;
+    uint64_t data_len;
+    uint64_t ndirs;
+    uint64_t dirs_off;
+    uint64_t dirs_len;
+    uint64_t nroots;
+    uint64_t roots_off;
+    uint64_t roots_len;
+    uint64_t flags;
+    int64_t max_depth;
+} fileindex_header;
+
+// Builder
+
+// Records of a fixed size header followed by the NUL-terminated path
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    // offsets of the records in buf
+    size_t *offs;
+    size_t n;
+    size_t alloc;
+} record_list;
+
+static void record_list_init(record_list *l) {
+    l->size = 64 * 1024;
+    l->buf = (char *)malloc(l->size * sizeof(char));
+    l->len = 0;
+    l->alloc = 1024;
+    l->offs = (size_t *)malloc(l->alloc * sizeof(size_t));
+    l->n = 0;
+}
+
+static void record_list_add(record_list *l, const void *head, size_t l_head,
+                            const char *path, size_t len) {
+    if (__builtin_expect(l->len + l_head + len + 1 > l->size, 0)) {
+        while (l->len + l_head + len + 1 > l->size) {
+            l->size *= 2;
+        }
+        l->buf = (char *)realloc(l->buf, l->size * sizeof(char));
+    }
+    if (__builtin_expect(l->n == l->alloc, 0)) {
+        l->alloc *= 2;
+        l->offs = (size_t *)realloc(l->offs, l->alloc * sizeof(size_t));
+    }
+
+    l->offs[l->n++] = l->len;
+    memcpy(l->buf + l->len, head, l_head);
+    memcpy(l->buf + l->len + l_head, path, len);
+    l->buf[l->len + l_head + len] = '\0';
+    l->len += l_head + len + 1;
+}
+
+struct _fileindex_builder {
+    // entries, headed by their type
+    record_list entries;
+    // directories, headed by their timestamp
+    record_list dirs;
+};
+
+fileindex_builder *fileindex_builder_new() {
+    fileindex_builder *b =
+        (fileindex_builder *)malloc(sizeof(fileindex_builder));
+    record_list_init(&b->entries);
+    record_list_init(&b->dirs);
+    return b;
+}
+
+void fileindex_builder_free(fileindex_builder *b) {
+    if (b == NULL) {
+        return;
+    }
+    free(b->entries.buf);
+    free(b->entries.offs);
+    free(b->dirs.buf);
+    free(b->dirs.offs);
+    free(b);
+    b = NULL;
+}
+
+void fileindex_builder_add(fileindex_builder *b, const char *path, size_t len,
+                           unsigned char type) {
+    record_list_add(&b->entries, &type, 1, path, len);
+}
+
+void fileindex_builder_add_dir(fileindex_builder *b, const char *path,
+                               size_t len, const fileindex_stamp *stamp) {
+    record_list_add(&b->dirs, stamp, sizeof(fileindex_stamp), path, len);
+}
+
+static int record_cmp(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+void fileindex_builder_visit(fileindex_builder *b,
+                             fileindex_dir_visitor dir,
+                             fileindex_entry_visitor entry, void *ctx) {
+    for (size_t i = 0; dir != NULL && i < b->dirs.n; ++i) {
+        const char *rec = b->dirs.buf + b->dirs.offs[i];
+        fileindex_stamp stamp;
+        memcpy(&stamp, rec, sizeof(fileindex_stamp));
+        const char *path = rec + sizeof(fileindex_stamp);
+        dir(ctx, path, strlen(path), &stamp);
+    }
+    for (size_t i = 0; entry != NULL && i < b->entries.n; ++i) {
+        const char *rec = b->entries.buf + b->entries.offs[i];
+        entry(ctx, rec + 1, strlen(rec + 1), (unsigned char)rec[0]);
+    }
+}
+
+// Gather the records of all builders and sort them by path
+static const char **collect(fileindex_builder **b, size_t n, bool dirs,
+                            size_t l_head, size_t *count) {
+    *count = 0;
+    for (size_t i = 0; i < n; ++i) {
+        *count += (dirs ? &b[i]->dirs : &b[i]->entries)->n;
+    }
+    const char **recs = (const char **)malloc((*count + 1) * sizeof(char *));
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const record_list *l = dirs ? &b[i]->dirs : &b[i]->entries;
+        for (size_t j = 0; j < l->n; ++j) {
+            recs[k++] = l->buf + l->offs[j] + l_head;
+        }
+    }
+    qsort(recs, *count, sizeof(char *), record_cmp);
+    return recs;
+}
+
+// Append a LEB128 encoded number, the buffer must have enough room
+static size_t varint_put(unsigned char *buf, size_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        buf[n++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[n++] = (unsigned char)value;
+    return n;
+}
+
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+    const char *prev;
+    size_t l_prev;
+} encoder;
+
+static void encoder_init(encoder *e) {
+    e->size = 64 * 1024;
+    e->data = (unsigned char *)malloc(e->size);
+    e->len = 0;
+    e->prev = "";
+    e->l_prev = 0;
+}
+
+// Front-code the path against the previous one, unless restarting,
+// and reserve room for extra bytes after it
+static unsigned char *encoder_put(encoder *e, const char *path, bool restart,
+                                  size_t extra) {
+    size_t l_path = strlen(path);
+    size_t prefix = 0;
+    if (!restart) {
+        while (prefix < e->l_prev && prefix < l_path
+               && e->prev[prefix] == path[prefix]) {
+            ++prefix;
+        }
+    }
+
+    // Two varints of at most ten bytes each, the suffix and the extra
+    if (e->len + l_path - prefix + 20 + extra > e->size) {
+        while (e->len + l_path - prefix + 20 + extra > e->size) {
+            e->size *= 2;
+        }
+        e->data = (unsigned char *)realloc(e->data, e->size);
+    }
+    e->len += varint_put(e->data + e->len, prefix);
+    e->len += varint_put(e->data + e->len, l_path - prefix);
+    memcpy(e->data + e->len, path + prefix, l_path - prefix);
+    e->len += l_path - prefix;
+
+    e->prev = path;
+    e->l_prev = l_path;
+    unsigned char *tail = e->data + e->len;
+    e->len += extra;
+    return tail;
+}
+
+static bool fwrite_all(const void *ptr, size_t size, FILE *fp) {
+    return size == 0 || fwrite(ptr, size, 1, fp) == 1;
+}
+
+bool fileindex_write(const char *file, fileindex_builder **b, size_t n,
+                     const fileindex_info *info) {
+    // Front-code the entries
+    size_t count;
+    const char **recs = collect(b, n, false, 1, &count);
+    size_t nblocks = (count + FILEINDEX_BLOCK - 1) / FILEINDEX_BLOCK;
+    uint64_t *blocks = (uint64_t *)malloc((nblocks + 1) * sizeof(uint64_t));
+    unsigned char *types = (unsigned char *)malloc(count + 1);
+    encoder data;
+    encoder_init(&data);
+    for (size_t i = 0; i < count; ++i) {
+        bool restart = i % FILEINDEX_BLOCK == 0;
+        if (restart) {
+            blocks[i / FILEINDEX_BLOCK] = data.len;
+        }
+        encoder_put(&data, recs[i], restart, 0);
+        types[i] = (unsigned char)recs[i][-1];
+    }
+    blocks[nblocks] = data.len;
+
+    // Front-code the directories
+    size_t ndirs;
+    const char **drecs = collect(b, n, true, sizeof(fileindex_stamp), &ndirs);
+    encoder dirs;
+    encoder_init(&dirs);
+    for (size_t i = 0; i < ndirs; ++i) {
+        unsigned char *tail =
+            encoder_put(&dirs, drecs[i], i == 0, sizeof(fileindex_stamp));
+        memcpy(tail, drecs[i] - sizeof(fileindex_stamp),
+               sizeof(fileindex_stamp));
+    }
+
+    size_t roots_len = 0;
+    for (size_t i = 0; i < info->nroots; ++i) {
+        roots_len += strlen(info->roots[i]) + 1;
+    }
+
+    fileindex_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, FILEINDEX_MAGIC, sizeof(h.magic));
+    h.count = count;
+    h.nblocks = nblocks;
+    h.blocks_off = sizeof(fileindex_header);
+    h.types_off = h.blocks_off + (nblocks + 1) * sizeof(uint64_t);
+    h.data_off = h.types_off + count;
+    h.data_len = data.len;
+    h.ndirs = ndirs;
+    h.dirs_off = h.data_off + h.data_len;
+    h.dirs_len = dirs.len;
+    h.nroots = info->nroots;
+    h.roots_off = h.dirs_off + h.dirs_len;
+    h.roots_len = roots_len;
+    h.flags = info->flags;
+    h.max_depth = info->max_depth;
+
+    // Write to a temporary file first, so that readers never see a
+    // partially written index.  Its name is unique, so that writers
+    // running at the same time do not write into each other's file.
+    size_t l_file = strlen(file);
+    char *tmp = (char *)malloc((l_file + sizeof(".XXXXXX")) * sizeof(char));
+    memcpy(tmp, file, l_file);
+    memcpy(tmp + l_file, ".XXXXXX", sizeof(".XXXXXX"));
+
+    bool ok = false;
+    int fd = mkstemp(tmp);
+    FILE *fp = NULL;
+    if (fd >= 0) {
+        // mkstemp creates the file for its owner only
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+        if ((fp = fdopen(fd, "wb")) == NULL) {
+            close(fd);
+            unlink(tmp);
+        }
+    }
+    if (fp == NULL) {
+        perror(tmp);
+    } else {
+        ok = fwrite_all(&h, sizeof(h), fp)
+             && fwrite_all(blocks, (nblocks + 1) * sizeof(uint64_t), fp)
+             && fwrite_all(types, count, fp)
+             && fwrite_all(data.data, data.len, fp)
+             && fwrite_all(dirs.data, dirs.len, fp);
+        for (size_t i = 0; ok && i < info->nroots; ++i) {
+            ok = fwrite_all(info->roots[i], strlen(info->roots[i]) + 1, fp);
+        }
+        ok = (fclose(fp) == 0) && ok;
+        if (ok && rename(tmp, file) != 0) {
+            ok = false;
+        }
+        if (!ok) {
+            perror(file);
+            unlink(tmp);
+        }
+    }
+
+    free(tmp);
+    free(dirs.data);
+    free(drecs);
+    free(data.data);
+    free(types);
+    free(blocks);
+    free(recs);
+    return ok;
+}
+
+// Reader
+
+struct _fileindex {
+    void *map;
+    size_t size;
+    const fileindex_header *h;
+    const uint64_t *blocks;
+    const unsigned char *types;
+    const unsigned char *data;
+};
+
+// Check that all the sections are where the header says and that the
+// blocks lie within the paths, so that nothing read later can point
+// outside the mapping.  None of the sums may wrap around.
+static bool header_valid(const fileindex_header *h, size_t size) {
+    uint64_t end, len;
+    if (memcmp(h->magic, FILEINDEX_MAGIC, sizeof(h->magic)) != 0
+        || h->nblocks
+               != h->count / FILEINDEX_BLOCK
+                      + (h->count % FILEINDEX_BLOCK != 0)
+        || h->blocks_off != sizeof(fileindex_header)
+        || __builtin_mul_overflow(h->nblocks + 1, sizeof(uint64_t), &len)
+        || __builtin_add_overflow(h->blocks_off, len, &end)
+        || h->types_off != end
+        || __builtin_add_overflow(end, h->count, &end) || h->data_off != end
+        || __builtin_add_overflow(end, h->data_len, &end)
+        || h->dirs_off != end
+        || __builtin_add_overflow(end, h->dirs_len, &end)
+        || h->roots_off != end
+        || __builtin_add_overflow(end, h->roots_len, &end) || end != size) {
+        return false;
+    }
+
+    // Every directory takes two varints and its stamp, every root its
+    // terminating NUL
+    if (h->ndirs > h->dirs_len / (2 + sizeof(fileindex_stamp))
+        || h->nroots > h->roots_len
+        || (h->roots_len > 0 && ((const char *)h)[size - 1] != '\0')) {
+        return false;
+    }
+
+    const uint64_t *blocks =
+        (const uint64_t *)((const char *)h + h->blocks_off);
+    for (uint64_t i = 0; i < h->nblocks; ++i) {
+        if (blocks[i] > blocks[i + 1]) {
+            return false;
+        }
+    }
+    return blocks[h->nblocks] <= h->data_len;
+}
+
+fileindex *fileindex_open(const char *file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(file);
+        return NULL;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) != 0
+        || (size_t)statbuf.st_size < sizeof(fileindex_header)) {
+        fprintf(stderr, "%s: Not a valid index\n", file);
+        close(fd);
+        return NULL;
+    }
+
+    size_t size = (size_t)statbuf.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(file);
+        return NULL;
+    }
+
+    if (!header_valid((const fileindex_header *)map, size)) {
+        fprintf(stderr, "%s: Not a valid index\n", file);
+        munmap(map, size);
+        return NULL;
+    }
+
+    const fileindex_header *h = (const fileindex_header *)map;
+    fileindex *ix = (fileindex *)malloc(sizeof(fileindex));
+    ix->map = map;
+    ix->size = size;
+    ix->h = h;
+    ix->blocks = (const uint64_t *)((const char *)map + h->blocks_off);
+    ix->types = (const unsigned char *)map + h->types_off;
+    ix->data = (const unsigned char *)map + h->data_off;
+    madvise(map, size, MADV_WILLNEED);
+    return ix;
+}
+
+void fileindex_close(fileindex *ix) {
+    if (ix == NULL) {
+        return;
+    }
+    munmap(ix->map, ix->size);
+    free(ix);
+    ix = NULL;
+}
+
+size_t fileindex_blocks(fileindex *ix) { return ix->h->nblocks; }
+
+// The roots point into the index and only the array has to be freed
+void fileindex_get_info(fileindex *ix, fileindex_info *info) {
+    info->flags = ix->h->flags;
+    info->max_depth = ix->h->max_depth;
+    info->nroots = 0;
+    info->roots = (const char **)malloc((ix->h->nroots + 1) * sizeof(char *));
+    const char *root = (const char *)ix->map + ix->h->roots_off;
+    const char *end = root + ix->h->roots_len;
+    while (info->nroots < ix->h->nroots && root < end) {
+        info->roots[info->nroots++] = root;
+        root += strlen(root) + 1;
+    }
+}
+
+// Cursor
+
+struct _fileindex_cursor {
+    fileindex *ix;
+    const unsigned char *pos;
+    const unsigned char *end;
+    size_t entry;
+    char *path;
+    size_t len;
+    size_t size;
+};
+
+fileindex_cursor *fileindex_cursor_new(fileindex *ix) {
+    fileindex_cursor *c = (fileindex_cursor *)malloc(sizeof(fileindex_cursor));
+    c->ix = ix;
+    c->pos = NULL;
+    c->end = NULL;
+    c->entry = 0;
+    c->size = 4096;
+    c->path = (char *)malloc(c->size * sizeof(char));
+    c->len = 0;
+    return c;
+}
+
+void fileindex_cursor_free(fileindex_cursor *c) {
+    if (c == NULL) {
+        return;
+    }
+    free(c->path);
+    free(c);
+    c = NULL;
+}
+
+void fileindex_cursor_seek(fileindex_cursor *c, size_t block) {
+    fileindex *ix = c->ix;
+    c->pos = ix->data + ix->blocks[block];
+    c->end = ix->data + ix->blocks[block + 1];
+    c->entry = block * FILEINDEX_BLOCK;
+    c->len = 0;
+}
+
+static bool varint_get(const unsigned char **pos, const unsigned char *end,
+                       size_t *value) {
+    size_t v = 0;
+    for (unsigned shift = 0; *pos < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*pos)++;
+        v |= (size_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool fileindex_cursor_next(fileindex_cursor *c, const char **path,
+                           size_t *len, unsigned char *type) {
+    size_t prefix, suffix;
+    if (c->pos >= c->end || c->entry >= c->ix->h->count
+        || !varint_get(&c->pos, c->end, &prefix)
+        || !varint_get(&c->pos, c->end, &suffix) || prefix > c->len
+        || suffix > (size_t)(c->end - c->pos)) {
+        return false;
+    }
+
+    if (__builtin_expect(prefix + suffix + 1 > c->size, 0)) {
+        while (prefix + suffix + 1 > c->size) {
+            c->size *= 2;
+        }
+        c->path = (char *)realloc(c->path, c->size * sizeof(char));
+    }
+    memcpy(c->path + prefix, c->pos, suffix);
+    c->pos += suffix;
+    c->len = prefix + suffix;
+    c->path[c->len] = '\0';
+
+    *path = c->path;
+    *len = c->len;
+    *type = c->ix->types[c->entry++];
+    return true;
+}
+
+// Directory listings
+//
+// To refresh an index, the directories which were read when it was
+// built are looked up by path together with their entries, so that a
+// directory which has not changed since does not have to be read again.
+
+typedef struct {
+    // offset of the path in the string buffer
+    size_t path;
+    size_t len;
+    fileindex_stamp stamp;
+    // range of its entries in the children array
+    size_t first;
+    size_t n;
+} dir_record;
+
+typedef struct {
+    size_t owner;
+    size_t name;
+    size_t namlen;
+    unsigned char type;
+} pending_child;
+
+struct _fileindex_dirs {
+    char *strings;
+    size_t l_strings;
+    size_t s_strings;
+    dir_record *dirs;
+    size_t ndirs;
+    // open addressing hash table of indices into dirs, plus one
+    size_t *table;
+    size_t mask;
+    fileindex_child *children;
+};
+
+static uint64_t hash_path(const char *path, size_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t strings_add(fileindex_dirs *d, const char *str, size_t len) {
+    if (__builtin_expect(d->l_strings + len + 1 > d->s_strings, 0)) {
+        while (d->l_strings + len + 1 > d->s_strings) {
+            d->s_strings *= 2;
+        }
+        d->strings = (char *)realloc(d->strings, d->s_strings * sizeof(char));
+    }
+    size_t off = d->l_strings;
+    memcpy(d->strings + off, str, len);
+    d->strings[off + len] = '\0';
+    d->l_strings += len + 1;
+    return off;
+}
+
+static dir_record *dirs_lookup(const fileindex_dirs *d, const char *path,
+                               size_t len) {
+    for (size_t i = hash_path(path, len) & d->mask; d->table[i] != 0;
+         i = (i + 1) & d->mask) {
+        dir_record *r = &d->dirs[d->table[i] - 1];
+        if (r->len == len && memcmp(d->strings + r->path, path, len) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+fileindex_dirs *fileindex_dirs_load(fileindex *ix) {
+    const fileindex_header *h = ix->h;
+    fileindex_dirs *d = (fileindex_dirs *)malloc(sizeof(fileindex_dirs));
+    d->s_strings = 64 * 1024;
+    d->strings = (char *)malloc(d->s_strings * sizeof(char));
+    d->l_strings = 0;
+    d->dirs = (dir_record *)malloc((h->ndirs + 1) * sizeof(dir_record));
+    d->ndirs = 0;
+    d->mask = 15;
+    while (d->mask + 1 < 2 * h->ndirs) {
+        d->mask = 2 * d->mask + 1;
+    }
+    d->table = (size_t *)calloc(d->mask + 1, sizeof(size_t));
+
+    // Decode the directories, stopping at the first corrupt record
+    const unsigned char *pos = (const unsigned char *)ix->map + h->dirs_off;
+    const unsigned char *end = pos + h->dirs_len;
+    size_t s_path = 4096, l_path = 0;
+    char *path = (char *)malloc(s_path * sizeof(char));
+    for (size_t i = 0; i < h->ndirs; ++i) {
+        size_t prefix, suffix;
+        if (!varint_get(&pos, end, &prefix) || !varint_get(&pos, end, &suffix)
+            || prefix > l_path
+            || suffix > (size_t)(end - pos)
+            || sizeof(fileindex_stamp) > (size_t)(end - pos) - suffix) {
+            break;
+        }
+        if (prefix + suffix + 1 > s_path) {
+            while (prefix + suffix + 1 > s_path) {
+                s_path *= 2;
+            }
+            path = (char *)realloc(path, s_path * sizeof(char));
+        }
+        memcpy(path + prefix, pos, suffix);
+        pos += suffix;
+        l_path = prefix + suffix;
+
+        dir_record *r = &d->dirs[d->ndirs];
+        memcpy(&r->stamp, pos, sizeof(fileindex_stamp));
+        pos += sizeof(fileindex_stamp);
+        if (dirs_lookup(d, path, l_path) != NULL) {
+            continue;
+        }
+        r->path = strings_add(d, path, l_path);
+        r->len = l_path;
+        r->first = 0;
+        r->n = 0;
+
+        size_t j = hash_path(path, l_path) & d->mask;
+        while (d->table[j] != 0) {
+            j = (j + 1) & d->mask;
+        }
+        d->table[j] = ++d->ndirs;
+    }
+    free(path);
+
+    // Assign every entry to the directory it is in
+    pending_child *pending =
+        (pending_child *)malloc((h->count + 1) * sizeof(pending_child));
+    size_t npending = 0;
+    fileindex_cursor *c = fileindex_cursor_new(ix);
+    for (size_t block = 0; block < h->nblocks; ++block) {
+        fileindex_cursor_seek(c, block);
+        const char *entry;
+        size_t len;
+        unsigned char type;
+        while (fileindex_cursor_next(c, &entry, &len, &type)) {
+            size_t slash = len;
+            while (slash > 0 && entry[slash - 1] != '/') {
+                --slash;
+            }
+            if (slash == 0) {
+                continue;
+            }
+            dir_record *r = dirs_lookup(d, entry, slash - 1);
+            if (r == NULL) {
+                continue;
+            }
+            pending_child *p = &pending[npending++];
+            p->owner = (size_t)(r - d->dirs);
+            p->name = strings_add(d, entry + slash, len - slash);
+            p->namlen = len - slash;
+            p->type = type;
+            ++r->n;
+        }
+    }
+    fileindex_cursor_free(c);
+
+    // Group the entries by directory
+    size_t first = 0;
+    for (size_t i = 0; i < d->ndirs; ++i) {
+        d->dirs[i].first = first;
+        first += d->dirs[i].n;
+        d->dirs[i].n = 0;
+    }
+    d->children =
+        (fileindex_child *)malloc((npending + 1) * sizeof(fileindex_child));
+    for (size_t i = 0; i < npending; ++i) {
+        dir_record *r = &d->dirs[pending[i].owner];
+        fileindex_child *child = &d->children[r->first + r->n++];
+        child->name = d->strings + pending[i].name;
+        child->namlen = pending[i].namlen;
+        child->type = pending[i].type;
+    }
+    free(pending);
+
+    return d;
+}
+
+void fileindex_dirs_free(fileindex_dirs *d) {
+    if (d == NULL) {
+        return;
+    }
+    free(d->children);
+    free(d->table);
+    free(d->dirs);
+    free(d->strings);
+    free(d);
+    d = NULL;
+}
+
+// Find the entries of the directory, provided it was read with the
+// same timestamp and ignore rules
+bool fileindex_dirs_find(const fileindex_dirs *d, const char *path,
+                         size_t len, const fileindex_stamp *stamp,
+                         const fileindex_child **children, size_t *n) {
+    const dir_record *r = dirs_lookup(d, path, len);
+    if (r == NULL || r->stamp.mtime != stamp->mtime
+        || r->stamp.ctime != stamp->ctime || r->stamp.rules != stamp->rules) {
+        return false;
+    }
+    *children = d->children + r->first;
+    *n = r->n;
+    return true;
+}
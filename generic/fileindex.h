@@ -0,0 +1,67 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct _fileindex fileindex;
+typedef struct _fileindex_builder fileindex_builder;
+typedef struct _fileindex_cursor fileindex_cursor;
+typedef struct _fileindex_dirs fileindex_dirs;
+
+// Modification and change time of a directory in nanoseconds, and a
+// fingerprint of the ignore rules its listing was filtered with
+typedef struct {
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t rules;
+} fileindex_stamp;
+
+// How the index was built, the flags are not interpreted by the index
+typedef struct {
+    uint64_t flags;
+    int64_t max_depth;
+    size_t nroots;
+    const char **roots;
+} fileindex_info;
+
+typedef struct {
+    const char *name;
+    size_t namlen;
+    unsigned char type;
+} fileindex_child;
+
+typedef void (*fileindex_dir_visitor)(void *ctx, const char *path, size_t len,
+                                      const fileindex_stamp *stamp);
+typedef void (*fileindex_entry_visitor)(void *ctx, const char *path,
+                                        size_t len, unsigned char type);
+
+fileindex_builder *fileindex_builder_new();
+void fileindex_builder_free(fileindex_builder *b);
+void fileindex_builder_add(fileindex_builder *b, const char *path, size_t len,
+                           unsigned char type);
+void fileindex_builder_add_dir(fileindex_builder *b, const char *path,
+                               size_t len, const fileindex_stamp *stamp);
+void fileindex_builder_visit(fileindex_builder *b,
+                             fileindex_dir_visitor dir,
+                             fileindex_entry_visitor entry, void *ctx);
+bool fileindex_write(const char *file, fileindex_builder **b, size_t n,
+                     const fileindex_info *info);
+
+fileindex *fileindex_open(const char *file);
+void fileindex_close(fileindex *ix);
+size_t fileindex_blocks(fileindex *ix);
+void fileindex_get_info(fileindex *ix, fileindex_info *info);
+
+fileindex_cursor *fileindex_cursor_new(fileindex *ix);
+void fileindex_cursor_free(fileindex_cursor *c);
+void fileindex_cursor_seek(fileindex_cursor *c, size_t block);
+bool fileindex_cursor_next(fileindex_cursor *c, const char **path,
+                           size_t *len, unsigned char *type);
+
+fileindex_dirs *fileindex_dirs_load(fileindex *ix);
+void fileindex_dirs_free(fileindex_dirs *d);
+bool fileindex_dirs_find(const fileindex_dirs *d, const char *path,
+                         size_t len, const fileindex_stamp *stamp,
+                         const fileindex_child **children, size_t *n);
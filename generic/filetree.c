@@ -0,0 +1,323 @@
+#include "filetree.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <dirent.h>
+
+// In-memory directory tree
+//
+// Every directory is a node holding the names and types of its
+// entries.  The nodes are found by their path or by the watch
+// descriptor that was registered for them, through two chained hash
+// tables.  Subdirectories are linked only by name, so a node for
+// "a/b" exists if and only if "a/b" was added as a directory.
+
+#define FILETREE_INITIAL_BUCKETS 1024
+
+struct _filetree_dir {
+    char *path;
+    size_t len;
+    filetree_entry *entries;
+    size_t n;
+    size_t alloc;
+    int watch;
+    void *data;
+    // chains of the hash tables
+    filetree_dir *next_path;
+    filetree_dir *next_watch;
+};
+
+struct _filetree {
+    filetree_dir **by_path;
+    filetree_dir **by_watch;
+    size_t mask;
+    size_t ndirs;
+    size_t nentries;
+};
+
+static uint64_t hash_path(const char *path, size_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)path[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+static size_t hash_watch(int watch) {
+    return (size_t)((uint64_t)(unsigned)watch * 11400714819323198485ULL
+                    >> 32);
+}
+
+filetree *filetree_new() {
+    filetree *t = (filetree *)malloc(sizeof(filetree));
+    t->mask = FILETREE_INITIAL_BUCKETS - 1;
+    t->by_path = (filetree_dir **)calloc(t->mask + 1, sizeof(filetree_dir *));
+    t->by_watch = (filetree_dir **)calloc(t->mask + 1, sizeof(filetree_dir *));
+    t->ndirs = 0;
+    t->nentries = 0;
+    return t;
+}
+
+static void dir_free(filetree_dir *d) {
+    for (size_t i = 0; i < d->n; ++i) {
+        free(d->entries[i].name);
+    }
+    free(d->entries);
+    free(d->path);
+    free(d);
+}
+
+void filetree_free(filetree *t) {
+    if (t == NULL) {
+        return;
+    }
+    for (size_t i = 0; i <= t->mask; ++i) {
+        filetree_dir *d = t->by_path[i];
+        while (d != NULL) {
+            filetree_dir *next = d->next_path;
+            dir_free(d);
+            d = next;
+        }
+    }
+    free(t->by_watch);
+    free(t->by_path);
+    free(t);
+    t = NULL;
+}
+
+size_t filetree_size(filetree *t) { return t->nentries; }
+
+// Double the number of buckets once there are more nodes than buckets
+static void rehash(filetree *t) {
+    size_t mask = 2 * t->mask + 1;
+    filetree_dir **by_path =
+        (filetree_dir **)calloc(mask + 1, sizeof(filetree_dir *));
+    filetree_dir **by_watch =
+        (filetree_dir **)calloc(mask + 1, sizeof(filetree_dir *));
+    for (size_t i = 0; i <= t->mask; ++i) {
+        filetree_dir *d = t->by_path[i];
+        while (d != NULL) {
+            filetree_dir *next = d->next_path;
+            size_t j = hash_path(d->path, d->len) & mask;
+            d->next_path = by_path[j];
+            by_path[j] = d;
+            if (d->watch >= 0) {
+                size_t k = hash_watch(d->watch) & mask;
+                d->next_watch = by_watch[k];
+                by_watch[k] = d;
+            }
+            d = next;
+        }
+    }
+    free(t->by_path);
+    free(t->by_watch);
+    t->by_path = by_path;
+    t->by_watch = by_watch;
+    t->mask = mask;
+}
+
+filetree_dir *filetree_find(filetree *t, const char *path, size_t len) {
+    for (filetree_dir *d = t->by_path[hash_path(path, len) & t->mask];
+         d != NULL; d = d->next_path) {
+        if (d->len == len && memcmp(d->path, path, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+filetree_dir *filetree_find_watch(filetree *t, int watch) {
+    for (filetree_dir *d = t->by_watch[hash_watch(watch) & t->mask];
+         d != NULL; d = d->next_watch) {
+        if (d->watch == watch) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+filetree_dir *filetree_add_dir(filetree *t, const char *path, size_t len) {
+    filetree_dir *d = filetree_find(t, path, len);
+    if (d != NULL) {
+        return d;
+    }
+
+    if (t->ndirs > t->mask) {
+        rehash(t);
+    }
+
+    d = (filetree_dir *)malloc(sizeof(filetree_dir));
+    d->path = (char *)malloc((len + 1) * sizeof(char));
+    memcpy(d->path, path, len);
+    d->path[len] = '\0';
+    d->len = len;
+    d->entries = NULL;
+    d->n = 0;
+    d->alloc = 0;
+    d->watch = -1;
+    d->data = NULL;
+    d->next_watch = NULL;
+
+    size_t i = hash_path(path, len) & t->mask;
+    d->next_path = t->by_path[i];
+    t->by_path[i] = d;
+    ++t->ndirs;
+    return d;
+}
+
+static void unlink_watch(filetree *t, filetree_dir *d) {
+    if (d->watch < 0) {
+        return;
+    }
+    filetree_dir **p = &t->by_watch[hash_watch(d->watch) & t->mask];
+    while (*p != d) {
+        p = &(*p)->next_watch;
+    }
+    *p = d->next_watch;
+    d->watch = -1;
+}
+
+void filetree_set_watch(filetree *t, filetree_dir *d, int watch) {
+    unlink_watch(t, d);
+    d->watch = watch;
+    if (watch >= 0) {
+        size_t i = hash_watch(watch) & t->mask;
+        d->next_watch = t->by_watch[i];
+        t->by_watch[i] = d;
+    }
+}
+
+int filetree_dir_watch(filetree_dir *d) { return d->watch; }
+
+const char *filetree_dir_path(filetree_dir *d, size_t *len) {
+    *len = d->len;
+    return d->path;
+}
+
+void **filetree_dir_data(filetree_dir *d) { return &d->data; }
+
+// Split the path into the directory node and the name of the entry
+static filetree_dir *parent_of(filetree *t, const char *path, size_t len,
+                               size_t *slash) {
+    *slash = len;
+    while (*slash > 0 && path[*slash - 1] != '/') {
+        --*slash;
+    }
+    if (*slash == 0) {
+        return NULL;
+    }
+    return filetree_find(t, path, *slash - 1);
+}
+
+// Add an entry to the node of its directory.  Unless the caller knows
+// that the entry is new, the existing entries are searched first.
+bool filetree_add(filetree *t, const char *path, size_t len,
+                  unsigned char type, bool unique) {
+    size_t slash;
+    filetree_dir *d = parent_of(t, path, len, &slash);
+    if (d == NULL) {
+        return false;
+    }
+    const char *name = path + slash;
+    size_t namlen = len - slash;
+
+    if (!unique) {
+        for (size_t i = 0; i < d->n; ++i) {
+            if (d->entries[i].namlen == namlen
+                && memcmp(d->entries[i].name, name, namlen) == 0) {
+                d->entries[i].type = type;
+                return false;
+            }
+        }
+    }
+
+    if (d->n == d->alloc) {
+        d->alloc = d->alloc ? 2 * d->alloc : 16;
+        d->entries = (filetree_entry *)realloc(
+            d->entries, d->alloc * sizeof(filetree_entry));
+    }
+    filetree_entry *e = &d->entries[d->n++];
+    e->name = (char *)malloc((namlen + 1) * sizeof(char));
+    memcpy(e->name, name, namlen);
+    e->name[namlen] = '\0';
+    e->namlen = namlen;
+    e->type = type;
+    ++t->nentries;
+    return true;
+}
+
+// Drop the node and those of all its subdirectories
+static void remove_dir(filetree *t, filetree_dir *d, filetree_forget forget,
+                       void *ctx) {
+    for (size_t i = 0; i < d->n; ++i) {
+        if (d->entries[i].type != DT_DIR) {
+            continue;
+        }
+        size_t len = d->len + 1 + d->entries[i].namlen;
+        char *path = (char *)malloc((len + 1) * sizeof(char));
+        memcpy(path, d->path, d->len);
+        path[d->len] = '/';
+        memcpy(path + d->len + 1, d->entries[i].name, d->entries[i].namlen);
+        path[len] = '\0';
+        filetree_dir *sub = filetree_find(t, path, len);
+        free(path);
+        if (sub != NULL) {
+            remove_dir(t, sub, forget, ctx);
+        }
+    }
+
+    if (forget != NULL) {
+        forget(ctx, d);
+    }
+    unlink_watch(t, d);
+
+    filetree_dir **p = &t->by_path[hash_path(d->path, d->len) & t->mask];
+    while (*p != d) {
+        p = &(*p)->next_path;
+    }
+    *p = d->next_path;
+    t->nentries -= d->n;
+    --t->ndirs;
+    dir_free(d);
+}
+
+// Remove an entry from its directory, and the whole subtree if it is
+// a directory itself
+void filetree_remove(filetree *t, const char *path, size_t len,
+                     filetree_forget forget, void *ctx) {
+    filetree_dir *sub = filetree_find(t, path, len);
+    if (sub != NULL) {
+        remove_dir(t, sub, forget, ctx);
+    }
+
+    size_t slash;
+    filetree_dir *d = parent_of(t, path, len, &slash);
+    if (d == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < d->n; ++i) {
+        if (d->entries[i].namlen == len - slash
+            && memcmp(d->entries[i].name, path + slash, len - slash) == 0) {
+            free(d->entries[i].name);
+            d->entries[i] = d->entries[--d->n];
+            --t->nentries;
+            return;
+        }
+    }
+}
+
+void filetree_visit(filetree *t, filetree_visitor visit, void *ctx) {
+    for (size_t i = 0; i <= t->mask; ++i) {
+        for (filetree_dir *d = t->by_path[i]; d != NULL; d = d->next_path) {
+            for (size_t j = 0; j < d->n; ++j) {
+                visit(ctx, d->path, d->len, &d->entries[j]);
+            }
+        }
+    }
+}
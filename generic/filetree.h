@@ -0,0 +1,37 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _filetree filetree;
+typedef struct _filetree_dir filetree_dir;
+
+typedef struct {
+    char *name;
+    size_t namlen;
+    unsigned char type;
+} filetree_entry;
+
+// Called for every directory node before it is dropped
+typedef void (*filetree_forget)(void *ctx, filetree_dir *d);
+typedef void (*filetree_visitor)(void *ctx, const char *dir, size_t l_dir,
+                                 const filetree_entry *entry);
+
+filetree *filetree_new();
+void filetree_free(filetree *t);
+size_t filetree_size(filetree *t);
+
+filetree_dir *filetree_add_dir(filetree *t, const char *path, size_t len);
+filetree_dir *filetree_find(filetree *t, const char *path, size_t len);
+filetree_dir *filetree_find_watch(filetree *t, int watch);
+void filetree_set_watch(filetree *t, filetree_dir *d, int watch);
+int filetree_dir_watch(filetree_dir *d);
+const char *filetree_dir_path(filetree_dir *d, size_t *len);
+void **filetree_dir_data(filetree_dir *d);
+
+bool filetree_add(filetree *t, const char *path, size_t len,
+                  unsigned char type, bool unique);
+void filetree_remove(filetree *t, const char *path, size_t len,
+                     filetree_forget forget, void *ctx);
+void filetree_visit(filetree *t, filetree_visitor visit, void *ctx);
@@ -5,23 +5,57 @@
 #include "git-compat-util.h"
 
 // POSIX C library
+#include <dirent.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 
 // C standard library
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// A list of patterns prepared for matching.  Patterns which are a
+// plain name, or a "*" followed by a plain suffix with a dot, are found
+// through hash tables on the name and on the extension.  Only the
+// others are tried one by one.  As in git, the last matching pattern
+// of the list decides, so the candidate with the highest index wins.
+typedef struct {
+    struct pattern_list *pl;
+    // heads of the chains of both tables, which are linked through
+    // next in descending order of the patterns, or -1
+    int *names;
+    int *exts;
+    int *next;
+    size_t mask;
+    // all other patterns in ascending order
+    int *rest;
+    int nrest;
+} ruleset;
+
+struct _gitignore {
+    // Root of the repository, the patterns are matched against paths
+    // relative to it
+    const gitignore *root;
+    char *path;
+    size_t pathlen;
+    // Frame of the closest parent directory with a .gitignore
+    const gitignore *parent;
+    // Directory of the .gitignore relative to the root, which the
+    // patterns keep referring to
+    char *base;
+    ruleset *rules;
+    // $GIT_DIR/info/exclude, only in the root frame
+    ruleset *exclude;
+};
+
 struct pattern_list *pattern_list_new(const char *path) {
-    struct pattern_list *pl = malloc(sizeof(*pl));
-    pl->nr = 0;
-    pl->alloc = 0;
-    pl->filebuf = NULL;
+    struct pattern_list *pl =
+        (struct pattern_list *)calloc(1, sizeof(struct pattern_list));
     pl->src = (path != NULL) ? strdup(path) : NULL;
-    pl->patterns = NULL;
     return pl;
 }
 
@@ -39,6 +73,161 @@ void pattern_list_free(struct pattern_list *pl) {
     pl = NULL;
 }
 
+static uint64_t hash_name(const char *name, size_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// The extension of a name including the dot, or NULL if it has none
+static const char *extension(const char *name, size_t len) {
+    for (size_t i = len; i > 0; --i) {
+        if (name[i - 1] == '.') {
+            return name + i - 1;
+        }
+    }
+    return NULL;
+}
+
+static ruleset *ruleset_new(struct pattern_list *pl) {
+    ruleset *rs = (ruleset *)malloc(sizeof(ruleset));
+    rs->pl = pl;
+
+    size_t nbuckets = 16;
+    while (nbuckets < (size_t)pl->nr) {
+        nbuckets *= 2;
+    }
+    rs->mask = nbuckets - 1;
+    rs->names = (int *)malloc(nbuckets * sizeof(int));
+    rs->exts = (int *)malloc(nbuckets * sizeof(int));
+    for (size_t i = 0; i < nbuckets; ++i) {
+        rs->names[i] = -1;
+        rs->exts[i] = -1;
+    }
+    rs->next = (int *)malloc((pl->nr + 1) * sizeof(int));
+    rs->rest = (int *)malloc((pl->nr + 1) * sizeof(int));
+    rs->nrest = 0;
+
+    for (int i = 0; i < pl->nr; ++i) {
+        const struct path_pattern *p = pl->patterns[i];
+        size_t len = (size_t)p->patternlen;
+        const char *ext = NULL;
+        int *head = NULL;
+        if (!(p->flags & PATTERN_FLAG_NODIR)) {
+            head = NULL;
+        } else if (p->nowildcardlen == p->patternlen) {
+            head = &rs->names[hash_name(p->pattern, len) & rs->mask];
+        } else if ((p->flags & PATTERN_FLAG_ENDSWITH)
+                   && (ext = extension(p->pattern + 1, len - 1)) != NULL) {
+            size_t extlen = (size_t)(p->pattern + len - ext);
+            head = &rs->exts[hash_name(ext, extlen) & rs->mask];
+        }
+
+        if (head != NULL) {
+            rs->next[i] = *head;
+            *head = i;
+        } else {
+            rs->rest[rs->nrest++] = i;
+        }
+    }
+    return rs;
+}
+
+static void ruleset_free(ruleset *rs) {
+    if (rs == NULL) {
+        return;
+    }
+    pattern_list_free(rs->pl);
+    free(rs->names);
+    free(rs->exts);
+    free(rs->next);
+    free(rs->rest);
+    free(rs);
+    rs = NULL;
+}
+
+// Patterns ending in a slash only match directories
+static bool applies(const struct path_pattern *p, int *dtype,
+                    const char *path) {
+    if (!(p->flags & PATTERN_FLAG_MUSTBEDIR)) {
+        return true;
+    }
+    if (*dtype == DT_UNKNOWN) {
+        struct stat statbuf;
+        *dtype = lstat(path, &statbuf) == 0 ? IFTODT(statbuf.st_mode) : DT_REG;
+    }
+    return *dtype == DT_DIR;
+}
+
+// Whether the last matching pattern of the list ignores the path, in
+// the same terms as path_matches_pattern_list.  The path is relative
+// to the root of the repository, the full path is only needed if the
+// type is unknown.
+static enum pattern_match_result ruleset_match(const ruleset *rs,
+                                               const char *path,
+                                               const char *rel, int rellen,
+                                               const char *base, int *dtype) {
+    struct path_pattern *const *patterns = rs->pl->patterns;
+    int namelen = (int)(rel + rellen - base);
+    int best = -1;
+
+    for (int i = rs->names[hash_name(base, namelen) & rs->mask]; i >= 0;
+         i = rs->next[i]) {
+        const struct path_pattern *p = patterns[i];
+        if (p->patternlen == namelen
+            && memcmp(p->pattern, base, (size_t)namelen) == 0
+            && applies(p, dtype, path)) {
+            best = i;
+            break;
+        }
+    }
+
+    const char *ext = extension(base, (size_t)namelen);
+    if (ext != NULL) {
+        size_t extlen = (size_t)(base + namelen - ext);
+        for (int i = rs->exts[hash_name(ext, extlen) & rs->mask]; i > best;
+             i = rs->next[i]) {
+            const struct path_pattern *p = patterns[i];
+            int suffixlen = p->patternlen - 1;
+            if (suffixlen <= namelen
+                && memcmp(p->pattern + 1, base + namelen - suffixlen,
+                          (size_t)suffixlen)
+                       == 0
+                && applies(p, dtype, path)) {
+                best = i;
+                break;
+            }
+        }
+    }
+
+    for (int k = rs->nrest - 1; k >= 0 && rs->rest[k] > best; --k) {
+        const struct path_pattern *p = patterns[rs->rest[k]];
+        if (!applies(p, dtype, path)) {
+            continue;
+        }
+        int matched =
+            (p->flags & PATTERN_FLAG_NODIR)
+                ? match_basename(base, namelen, p->pattern, p->nowildcardlen,
+                                 p->patternlen, p->flags)
+                : match_pathname(rel, rellen, p->base,
+                                 p->baselen ? p->baselen - 1 : 0, p->pattern,
+                                 p->nowildcardlen, p->patternlen);
+        if (matched) {
+            best = rs->rest[k];
+            break;
+        }
+    }
+
+    if (best < 0) {
+        return UNDECIDED;
+    }
+    return (patterns[best]->flags & PATTERN_FLAG_NEGATIVE) ? NOT_MATCHED
+                                                           : MATCHED;
+}
+
 bool isfile(const char *path) {
     struct stat statbuf;
     if (lstat(path, &statbuf) != 0) {
@@ -47,15 +236,32 @@ bool isfile(const char *path) {
     return S_ISREG(statbuf.st_mode);
 }
 
-bool isdir(const char *path) {
+static ruleset *gitignore_global = NULL;
+
+// Fold the inode, size and timestamps of a file into a fingerprint.  A
+// missing file leaves it as it is.
+static uint64_t stamp_file(uint64_t h, int dirfd, const char *file) {
     struct stat statbuf;
-    if (lstat(path, &statbuf) != 0) {
-        return false;
+    if (fstatat(dirfd, file, &statbuf, 0) != 0) {
+        return h;
     }
-    return S_ISDIR(statbuf.st_mode);
+    const uint64_t fields[] = {
+        (uint64_t)statbuf.st_ino,
+        (uint64_t)statbuf.st_size,
+        (uint64_t)statbuf.st_mtim.tv_sec * 1000000000ULL
+            + (uint64_t)statbuf.st_mtim.tv_nsec,
+        (uint64_t)statbuf.st_ctim.tv_sec * 1000000000ULL
+            + (uint64_t)statbuf.st_ctim.tv_nsec,
+    };
+    // FNV-1a over whole fields
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        h = (h ^ fields[i]) * 1099511628211ULL;
+    }
+    return h;
 }
 
-static gitignore *gitignore_global = NULL;
+// Fingerprint of the global file, which every repository starts from
+static uint64_t gitignore_global_stamp = 14695981039346656037ULL;
 
 void gitignore_init_global() {
     // Check for and parse the global .gitignore file
@@ -78,6 +284,10 @@ void gitignore_init_global() {
                sizeof("/.config/git/ignore"));
     }
 
+    if (ignorehome != NULL) {
+        gitignore_global_stamp =
+            stamp_file(gitignore_global_stamp, AT_FDCWD, ignorehome);
+    }
     if (ignorehome == NULL || !isfile(ignorehome)) {
         free(ignorehome);
         gitignore_global = NULL;
@@ -92,83 +302,167 @@ void gitignore_init_global() {
     }
 
     free(ignorehome);
-    gitignore_global = pl;
+    gitignore_global = ruleset_new(pl);
 }
 
-void gitignore_free_global() { pattern_list_free(gitignore_global); }
+void gitignore_free_global() { ruleset_free(gitignore_global); }
 
-gitignore *gitignore_new(const char *path) {
-    if (!isdir(path)) {
+// Read the patterns from a file, or return NULL if it is missing
+static ruleset *load_patterns(const char *file, const char *base,
+                              size_t baselen) {
+    struct pattern_list *pl = pattern_list_new(NULL);
+    if (add_patterns_from_file_to_list(file, base, (int)baselen, pl, NULL)
+        != 0) {
+        pattern_list_free(pl);
         return NULL;
     }
+    return ruleset_new(pl);
+}
+
+static gitignore *frame_new(const gitignore *parent, char *base) {
+    gitignore *g = (gitignore *)malloc(sizeof(gitignore));
+    g->root = parent != NULL ? parent->root : g;
+    g->path = NULL;
+    g->pathlen = 0;
+    g->parent = parent;
+    g->base = base;
+    g->rules = NULL;
+    g->exclude = NULL;
+    return g;
+}
 
+// The bottom frame of a repository, i.e. a directory which contains
+// .git.  Probe for it, unless the caller already knows.
+gitignore *gitignore_new(const char *path) {
     size_t pathlen = strlen(path);
-    size_t len = pathlen + sizeof("/.gitignore");
-    char *git = (char *)malloc(len * sizeof(char));
+    char *git = (char *)malloc((pathlen + sizeof("/.git")) * sizeof(char));
     memcpy(git, path, pathlen);
+    memcpy(git + pathlen, "/.git", sizeof("/.git"));
 
     // Check if this directory is managed by git
-    memcpy(git + pathlen, "/.git", sizeof("/.git"));
-    if (!isdir(git)) {
-        free(git);
-        return NULL;
-    }
+    struct stat statbuf;
+    bool repo = lstat(git, &statbuf) == 0;
+    free(git);
+    return repo ? gitignore_repo(path, pathlen) : NULL;
+}
 
-    // Check if there is a .gitignore file
-    memcpy(git + pathlen, "/.gitignore", sizeof("/.gitignore"));
-    if (!isfile(git)) {
-        free(git);
-        return NULL;
-    }
+gitignore *gitignore_repo(const char *path, size_t pathlen) {
+    size_t len = pathlen + sizeof("/.git/info/exclude");
+    char *git = (char *)malloc(len * sizeof(char));
+    memcpy(git, path, pathlen);
 
-    struct pattern_list *pl = pattern_list_new(path);
-    if (add_patterns_from_file_to_list(git, "", 0, pl, NULL) != 0) {
-        pattern_list_free(pl);
-        free(git);
-        return NULL;
-    }
+    gitignore *g = frame_new(NULL, strdup(""));
+    g->path = strndup(path, pathlen);
+    g->pathlen = pathlen;
+    memcpy(git + pathlen, "/.gitignore", sizeof("/.gitignore"));
+    g->rules = load_patterns(git, g->base, 0);
+    memcpy(git + pathlen, "/.git/info/exclude", sizeof("/.git/info/exclude"));
+    g->exclude = load_patterns(git, g->base, 0);
 
     free(git);
-    return pl;
+    return g;
 }
 
-void gitignore_free(gitignore *g) { pattern_list_free(g); }
+// A fingerprint of the ignore files in effect in a directory, given
+// the one of its parent.  It changes whenever one of them, or one of
+// the parent, is edited, created or removed.  The root of a
+// repository starts over from the global file and also covers
+// $GIT_DIR/info/exclude.  The path is relative to dirfd.
+uint64_t gitignore_stamp(uint64_t parent, int dirfd, const char *path,
+                         size_t pathlen) {
+    size_t len = pathlen + sizeof("/.git/info/exclude");
+    char *file = (char *)malloc(len * sizeof(char));
+    memcpy(file, path, pathlen);
 
-const char *relpath(const char *path, const char *start) {
-    assert(path != NULL);
-    if (start == NULL) {
-        start = ".";
+    uint64_t h = parent;
+    struct stat statbuf;
+    memcpy(file + pathlen, "/.git", sizeof("/.git"));
+    if (fstatat(dirfd, file, &statbuf, AT_SYMLINK_NOFOLLOW) == 0) {
+        memcpy(file + pathlen, "/.git/info/exclude",
+               sizeof("/.git/info/exclude"));
+        h = stamp_file(gitignore_global_stamp, dirfd, file);
     }
+    memcpy(file + pathlen, "/.gitignore", sizeof("/.gitignore"));
+    h = stamp_file(h, dirfd, file);
 
-    while (*path == *start) {
-        ++path;
-        ++start;
-    }
+    free(file);
+    return h;
+}
+
+// The frame for a subdirectory, or NULL if it has no .gitignore and
+// the parent frame applies unchanged
+gitignore *gitignore_push(const gitignore *parent, const char *path,
+                          size_t pathlen) {
+    assert(parent != NULL);
+    const gitignore *root = parent->root;
+    assert(pathlen > root->pathlen);
+
+    char *file =
+        (char *)malloc((pathlen + sizeof("/.gitignore")) * sizeof(char));
+    memcpy(file, path, pathlen);
+    memcpy(file + pathlen, "/.gitignore", sizeof("/.gitignore"));
 
-    while (*path == '/') {
-        ++path;
+    // The patterns are anchored at the directory relative to the root
+    size_t baselen = pathlen - root->pathlen;
+    char *base = (char *)malloc((baselen + 1) * sizeof(char));
+    memcpy(base, path + root->pathlen + 1, baselen - 1);
+    base[baselen - 1] = '/';
+    base[baselen] = '\0';
+
+    ruleset *rules = load_patterns(file, base, baselen);
+    free(file);
+    if (rules == NULL) {
+        free(base);
+        return NULL;
     }
 
-    return path;
+    gitignore *g = frame_new(parent, base);
+    g->rules = rules;
+    return g;
+}
+
+void gitignore_free(gitignore *g) {
+    if (g == NULL) {
+        return;
+    }
+    ruleset_free(g->rules);
+    ruleset_free(g->exclude);
+    free(g->base);
+    free(g->path);
+    free(g);
+    g = NULL;
 }
 
-bool gitignore_is_ignored(gitignore *g, char *path, size_t pathlen, int dtype) {
+// Git's order of precedence: the .gitignore closest to the path
+// first, then $GIT_DIR/info/exclude, then the global file.  Within
+// each of them the last matching pattern decides.
+bool gitignore_is_ignored(const gitignore *g, const char *path,
+                          size_t pathlen, int dtype) {
     assert(g != NULL);
+    const gitignore *root = g->root;
+    assert(pathlen > root->pathlen);
 
-    char *base = basename(path);
+    const char *rel = path + root->pathlen + 1;
+    int rellen = (int)(pathlen - root->pathlen - 1);
+    const char *base = rel + rellen;
+    while (base > rel && base[-1] != '/') {
+        --base;
+    }
 
     enum pattern_match_result res = UNDECIDED;
-
-    if (gitignore_global != NULL) {
-        res = path_matches_pattern_list(path, pathlen, base, &dtype,
-                                        gitignore_global, NULL);
+    for (const gitignore *f = g; f != NULL && res == UNDECIDED;
+         f = f->parent) {
+        if (f->rules != NULL) {
+            res = ruleset_match(f->rules, path, rel, rellen, base, &dtype);
+        }
     }
-
-    if (res == UNDECIDED) {
-        const char *rel = relpath(path, g->src);
-        size_t rellen = pathlen - (rel - path);
-        res = path_matches_pattern_list(rel, rellen, base, &dtype, g, NULL);
+    if (res == UNDECIDED && root->exclude != NULL) {
+        res = ruleset_match(root->exclude, path, rel, rellen, base, &dtype);
+    }
+    if (res == UNDECIDED && gitignore_global != NULL) {
+        res = ruleset_match(gitignore_global, path, rel, rellen, base,
+                            &dtype);
     }
 
-    return res != UNDECIDED;
+    return res == MATCHED;
 }
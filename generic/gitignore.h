@@ -3,11 +3,22 @@
 // C standard library
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-typedef struct pattern_list gitignore;
+// The ignore rules in effect in a directory form a stack with one
+// frame for every directory between the root of the repository and
+// itself that has a .gitignore.  A frame refers to the frame below
+// it, which has to outlive it.
+typedef struct _gitignore gitignore;
 
 void gitignore_init_global();
 void gitignore_free_global();
 gitignore *gitignore_new(const char *path);
+gitignore *gitignore_repo(const char *path, size_t pathlen);
+gitignore *gitignore_push(const gitignore *parent, const char *path,
+                          size_t pathlen);
 void gitignore_free(gitignore *g);
-bool gitignore_is_ignored(gitignore *g, char *path, size_t pathlen, int dtype);
+uint64_t gitignore_stamp(uint64_t parent, int dirfd, const char *path,
+                         size_t pathlen);
+bool gitignore_is_ignored(const gitignore *g, const char *path,
+                          size_t pathlen, int dtype);
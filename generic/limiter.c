@@ -0,0 +1,115 @@
+#include "limiter.h"
+
+// C standard library
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+// POSIX C library
+#include <pthread.h>
+
+// Limits on the number of results and the time spent
+//
+// Everybody doing work polls limiter_stopped, which is a single load
+// and cheap enough to call for every entry.  The flag is raised when
+// the last result has been taken or, by a timer thread, when the
+// deadline has passed.  A NULL limiter never stops.
+
+struct _limiter {
+    bool stopped;
+    size_t count;
+    size_t max_count;
+
+    // timer
+    bool has_timer;
+    bool done;
+    struct timespec deadline;
+    pthread_t timer;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+};
+
+static void *limiter_timer(void *arg) {
+    limiter *l = (limiter *)arg;
+    pthread_mutex_lock(&l->lock);
+    while (!l->done) {
+        if (pthread_cond_timedwait(&l->wakeup, &l->lock, &l->deadline)
+            == ETIMEDOUT) {
+            __atomic_store_n(&l->stopped, true, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+    return NULL;
+}
+
+// Stop after max_count results or timeout nanoseconds, where 0 means
+// no limit
+limiter *limiter_new(size_t max_count, long long timeout) {
+    limiter *l = (limiter *)malloc(sizeof(limiter));
+    l->stopped = false;
+    l->count = 0;
+    l->max_count = max_count;
+    l->has_timer = timeout > 0;
+    l->done = false;
+    if (l->has_timer) {
+        clock_gettime(CLOCK_MONOTONIC, &l->deadline);
+        l->deadline.tv_sec += (time_t)(timeout / 1000000000LL);
+        l->deadline.tv_nsec += (long)(timeout % 1000000000LL);
+        if (l->deadline.tv_nsec >= 1000000000L) {
+            l->deadline.tv_sec += 1;
+            l->deadline.tv_nsec -= 1000000000L;
+        }
+
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&l->wakeup, &attr);
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_init(&l->lock, NULL);
+        pthread_create(&l->timer, NULL, &limiter_timer, l);
+    }
+    return l;
+}
+
+void limiter_free(limiter *l) {
+    if (l == NULL) {
+        return;
+    }
+    if (l->has_timer) {
+        pthread_mutex_lock(&l->lock);
+        l->done = true;
+        pthread_cond_signal(&l->wakeup);
+        pthread_mutex_unlock(&l->lock);
+        pthread_join(l->timer, NULL);
+        pthread_cond_destroy(&l->wakeup);
+        pthread_mutex_destroy(&l->lock);
+    }
+    free(l);
+    l = NULL;
+}
+
+// Claim one result.  Returns false if it is over the limit or the
+// time is up.  Taking the last one stops everybody else right away.
+bool limiter_take(limiter *l) {
+    if (l == NULL) {
+        return true;
+    }
+    if (__atomic_load_n(&l->stopped, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    if (l->max_count == 0) {
+        return true;
+    }
+    size_t n = __atomic_add_fetch(&l->count, 1, __ATOMIC_RELAXED);
+    if (n >= l->max_count) {
+        __atomic_store_n(&l->stopped, true, __ATOMIC_RELEASE);
+    }
+    return n <= l->max_count;
+}
+
+bool limiter_stopped(const limiter *l) {
+    return l != NULL && __atomic_load_n(&l->stopped, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _limiter limiter;
+
+limiter *limiter_new(size_t max_count, long long timeout);
+void limiter_free(limiter *l);
+bool limiter_take(limiter *l);
+bool limiter_stopped(const limiter *l);
@@ -3,16 +3,17 @@
 #endif
 
 #include "message.h"
+#include "pool.h"
 
 // C standard library
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 
 // POSIX C library
 #include <pthread.h>
-#include <semaphore.h>
 
 // Message container
 
@@ -21,8 +22,14 @@ struct _message {
     void *data;
 };
 
+static pool *message_pool = NULL;
+
+void message_init_global() { message_pool = pool_new(sizeof(message)); }
+
+void message_free_global() { pool_free(message_pool); }
+
 message *message_new(void *data, void (*freefn)(void *)) {
-    message *msg = (message *)malloc(sizeof(message));
+    message *msg = (message *)pool_alloc(message_pool);
     msg->freefn = freefn;
     msg->data = data;
     return msg;
@@ -35,32 +42,154 @@ void message_free(message *msg) {
         return;
     }
     msg->freefn(msg->data);
-    free(msg);
+    pool_release(message_pool, msg);
     msg = NULL;
 }
 
 // Message queue
+//
+// The queue is a set of work-stealing deques, one per worker, plus a
+// shared priority heap.  Workers push and take messages on their own
+// deque without locking, idle workers steal from the others.  The
+// shared heap receives messages from outside the workers and
+// messages which did not fit into a full deque.
 
+#define DEQUE_CAPACITY 4096
+
+// The heap is ordered by priority, highest first in deep order and
+// lowest first in shallow order.  Messages with equal priority leave
+// the heap in the order they were inserted, except for
+// queue_put_head which always jumps the line.
+// This is achieved by a sequence number which counts up for
+// queue_put and down for queue_put_head.
 typedef struct _node node;
 struct _node {
     size_t priority;
+    long seq;
     message *msg;
-    node *next;
+};
+
+// The deque follows Chase and Lev, "Dynamic Circular Work-Stealing
+// Deque" (SPAA 2005) with the memory orderings from Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models"
+// (PPoPP 2013).  The owner pushes and takes at the bottom, thieves
+// steal from the top.  Because a worker pushes the children of the
+// directory it just took, the deque stays sorted by depth and the
+// owner always continues with its deepest directory, just like the
+// shared priority heap would.  To go shallow first instead, the owner
+// takes from the top like the thieves.
+struct _deque {
+    queue *q;
+    size_t id;
+    long top;
+    char pad[64 - sizeof(long)];
+    long bottom;
+    message *buf[DEQUE_CAPACITY];
 };
 
 struct _queue {
-    sem_t length;
-    node *head;
-    node *tail;
+    // shared priority heap
+    node *heap;
+    size_t capacity;
+    size_t length;
+    long head_seq;
+    long tail_seq;
     pthread_mutex_t lock;
+
+    // per-worker deques
+    deque *deques;
+    size_t nworkers;
+    size_t attached;
+
+    // idle workers
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    int sleepers;
+    bool closed;
+
+    queue_order order;
 };
 
-queue *queue_new() {
+static bool deque_push(deque *d, message *msg) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    if (b - t >= DEQUE_CAPACITY) {
+        return false;
+    }
+    __atomic_store_n(&d->buf[b % DEQUE_CAPACITY], msg, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+static message *deque_take(deque *d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+
+    message *msg = NULL;
+    if (t <= b) {
+        msg = __atomic_load_n(&d->buf[b % DEQUE_CAPACITY], __ATOMIC_RELAXED);
+        if (t == b) {
+            // This is the last item, so we race against the thieves
+            if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                             __ATOMIC_SEQ_CST,
+                                             __ATOMIC_RELAXED)) {
+                msg = NULL;
+            }
+            __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    } else {
+        // The deque was empty
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return msg;
+}
+
+static message *deque_steal(deque *d) {
+    for (;;) {
+        long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) {
+            return NULL;
+        }
+
+        message *msg =
+            __atomic_load_n(&d->buf[t % DEQUE_CAPACITY], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            return msg;
+        }
+    }
+}
+
+queue *queue_new(size_t nworkers) {
+    assert(nworkers > 0);
     queue *q = (queue *)malloc(sizeof(queue));
-    sem_init(&q->length, 0, 0);
-    q->head = NULL;
-    q->tail = NULL;
+    q->capacity = 64;
+    q->heap = (node *)malloc(q->capacity * sizeof(node));
+    q->length = 0;
+    q->head_seq = 0;
+    q->tail_seq = 0;
     pthread_mutex_init(&q->lock, NULL);
+
+    q->deques = (deque *)malloc(nworkers * sizeof(deque));
+    for (size_t i = 0; i < nworkers; ++i) {
+        q->deques[i].q = q;
+        q->deques[i].id = i;
+        q->deques[i].top = 0;
+        q->deques[i].bottom = 0;
+    }
+    q->nworkers = nworkers;
+    q->attached = 0;
+
+    pthread_mutex_init(&q->idle_lock, NULL);
+    pthread_cond_init(&q->idle, NULL);
+    q->sleepers = 0;
+    q->closed = false;
+    q->order = QUEUE_DEEP_FIRST;
     return q;
 }
 
@@ -68,104 +197,214 @@ void queue_free(queue *q) {
     if (q == NULL) {
         return;
     }
-    sem_destroy(&q->length);
     pthread_mutex_destroy(&q->lock);
+    pthread_mutex_destroy(&q->idle_lock);
+    pthread_cond_destroy(&q->idle);
+    free(q->heap);
+    free(q->deques);
     free(q);
 }
 
-void queue_put(queue *q, message *msg, size_t priority) {
-    node *new_node = (node *)malloc(sizeof(node));
-    new_node->priority = priority;
-    new_node->msg = msg;
-    new_node->next = NULL;
+// Wake up one idle worker, if there is any.  The fence pairs with the
+// one implied by incrementing the sleepers in deque_get, so either
+// the sleeper sees the new message or we see the sleeper.
+static void queue_wake(queue *q) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleepers, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&q->idle_lock);
+        pthread_cond_signal(&q->idle);
+        pthread_mutex_unlock(&q->idle_lock);
+    }
+}
 
-    pthread_mutex_lock(&q->lock);
-    if (q->head == NULL || q->tail == NULL) {
-        // If the list was empty, create the first node
-        q->head = new_node;
-        q->tail = new_node;
-    } else {
-        // Walk the list until an item with lower priority is found or
-        // the list has ended
-        node *p = q->head;
-        while (p != q->tail && p->priority > priority) {
-            if (p->next == NULL) {
-                break;
-            }
-            p = p->next;
+static bool node_before(const queue *q, const node *a, const node *b) {
+    if (a->priority != b->priority) {
+        if (a->priority == QUEUE_PRIORITY_MAX
+            || b->priority == QUEUE_PRIORITY_MAX) {
+            return a->priority == QUEUE_PRIORITY_MAX;
         }
+        return q->order == QUEUE_SHALLOW_FIRST ? a->priority < b->priority
+                                               : a->priority > b->priority;
+    }
+    return a->seq < b->seq;
+}
+
+// Move the node at i down to its place among the first length nodes.
+// Must be called with the lock held.
+static void heap_sift_down(queue *q, size_t i, size_t length) {
+    node n = q->heap[i];
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= length) {
+            break;
+        }
+        if (child + 1 < length
+            && node_before(q, &q->heap[child + 1], &q->heap[child])) {
+            ++child;
+        }
+        if (!node_before(q, &q->heap[child], &n)) {
+            break;
+        }
+        q->heap[i] = q->heap[child];
+        i = child;
+    }
+    q->heap[i] = n;
+}
 
-        // Insert new item
-        node *next = p->next;
-        p->next = new_node;
-        new_node->next = next;
+// Insert into the binary heap.  Must be called with the lock held.
+static void heap_push(queue *q, node n) {
+    if (__builtin_expect(q->length == q->capacity, 0)) {
+        q->capacity *= 2;
+        q->heap = (node *)realloc(q->heap, q->capacity * sizeof(node));
     }
+
+    // Sift up
+    size_t i = q->length;
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!node_before(q, &n, &q->heap[parent])) {
+            break;
+        }
+        q->heap[i] = q->heap[parent];
+        i = parent;
+    }
+    q->heap[i] = n;
+    __atomic_add_fetch(&q->length, 1, __ATOMIC_SEQ_CST);
+}
+
+// Remove the top of the binary heap.  Must be called with the lock
+// held and a non-empty heap.
+static message *heap_pop(queue *q) {
+    message *msg = q->heap[0].msg;
+    size_t length = __atomic_sub_fetch(&q->length, 1, __ATOMIC_SEQ_CST);
+    q->heap[0] = q->heap[length];
+    heap_sift_down(q, 0, length);
+    return msg;
+}
+
+void queue_put(queue *q, message *msg, size_t priority) {
+    node new_node;
+    new_node.priority = priority;
+    new_node.msg = msg;
+
+    pthread_mutex_lock(&q->lock);
+    new_node.seq = q->tail_seq++;
+    heap_push(q, new_node);
     pthread_mutex_unlock(&q->lock);
 
-    sem_post(&q->length);
+    queue_wake(q);
 }
 
 void queue_put_head(queue *q, message *msg) {
-    node *new_node = (node *)malloc(sizeof(node));
-    new_node->priority = QUEUE_PRIORITY_MAX;
-    new_node->msg = msg;
-    new_node->next = NULL;
+    node new_node;
+    new_node.priority = QUEUE_PRIORITY_MAX;
+    new_node.msg = msg;
 
     pthread_mutex_lock(&q->lock);
-    if (q->head == NULL && q->tail == NULL) {
-        // If the list was empty, create the first node
-        q->head = new_node;
-        q->tail = new_node;
-    } else {
-        // next of the new node will be the current head
-        new_node->next = q->head;
-        q->head = new_node;
-    }
+    new_node.seq = --q->head_seq;
+    heap_push(q, new_node);
     pthread_mutex_unlock(&q->lock);
 
-    sem_post(&q->length);
+    queue_wake(q);
 }
 
-void queue_put_tail(queue *q, message *msg) {
-    node *new_node = (node *)malloc(sizeof(node));
-    new_node->priority = QUEUE_PRIORITY_MIN;
-    new_node->msg = msg;
-    new_node->next = NULL;
+static message *queue_pop(queue *q) {
+    if (__atomic_load_n(&q->length, __ATOMIC_SEQ_CST) == 0) {
+        return NULL;
+    }
 
+    message *msg = NULL;
     pthread_mutex_lock(&q->lock);
-    if (q->head == NULL && q->tail == NULL) {
-        // If the list was empty, create the first node
-        q->head = new_node;
-        q->tail = new_node;
-    } else {
-        // next of the current tail will be the new tail
-        q->tail->next = new_node;
-        q->tail = new_node;
+    if (q->length > 0) {
+        msg = heap_pop(q);
     }
     pthread_mutex_unlock(&q->lock);
 
-    sem_post(&q->length);
+    return msg;
 }
 
-message *queue_get(queue *q) {
-    // Wait until the queue is non-empty
-    sem_wait(&q->length);
+void queue_close(queue *q) {
+    pthread_mutex_lock(&q->idle_lock);
+    q->closed = true;
+    pthread_cond_broadcast(&q->idle);
+    pthread_mutex_unlock(&q->idle_lock);
+}
 
-    message *msg = NULL;
+// The order can be changed while the workers are running.  The
+// shared heap is rebuilt for the new order so that the messages
+// already waiting in it follow the new order, too.
+void queue_set_order(queue *q, queue_order order) {
     pthread_mutex_lock(&q->lock);
-    // Retrieve the message and free the node
-    msg = q->head->msg;
-    node *oldhead = q->head;
-    if (q->head->next) {
-        // next is new head
-        q->head = q->head->next;
-    } else {
-        // if there is no next, queue is empty
-        q->head = NULL;
-        q->tail = NULL;
+    if (q->order != order) {
+        __atomic_store_n(&q->order, order, __ATOMIC_RELAXED);
+        for (size_t i = q->length / 2; i-- > 0;) {
+            heap_sift_down(q, i, q->length);
+        }
     }
-    free(oldhead);
     pthread_mutex_unlock(&q->lock);
+}
+
+queue_order queue_get_order(queue *q) {
+    return __atomic_load_n(&q->order, __ATOMIC_RELAXED);
+}
+
+deque *queue_attach(queue *q) {
+    size_t id = __atomic_fetch_add(&q->attached, 1, __ATOMIC_SEQ_CST);
+    assert(id < q->nworkers);
+    return &q->deques[id];
+}
+
+void deque_put(deque *d, message *msg, size_t priority) {
+    if (!deque_push(d, msg)) {
+        // The deque is full, so the message spills into the shared
+        // heap which also wakes up idle workers
+        queue_put(d->q, msg, priority);
+        return;
+    }
+    queue_wake(d->q);
+}
+
+// Look for work in our own deque first, then in the shared heap and
+// finally try to steal from the other workers
+static message *deque_find(deque *d) {
+    queue *q = d->q;
+    message *msg = NULL;
+    if ((msg = queue_get_order(q) == QUEUE_SHALLOW_FIRST ? deque_steal(d)
+                                                         : deque_take(d))
+        != NULL) {
+        return msg;
+    }
+
+    if ((msg = queue_pop(q)) != NULL) {
+        return msg;
+    }
+
+    for (size_t i = 1; i < q->nworkers; ++i) {
+        deque *victim = &q->deques[(d->id + i) % q->nworkers];
+        if ((msg = deque_steal(victim)) != NULL) {
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+message *deque_get(deque *d) {
+    message *msg = NULL;
+    if ((msg = deque_find(d)) != NULL) {
+        return msg;
+    }
+
+    // Nothing to do, so go to sleep until new work arrives or the
+    // queue is closed.  The search is repeated after registering as a
+    // sleeper to not miss a wake up.
+    queue *q = d->q;
+    pthread_mutex_lock(&q->idle_lock);
+    __atomic_add_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    while ((msg = deque_find(d)) == NULL && !q->closed) {
+        pthread_cond_wait(&q->idle, &q->idle_lock);
+    }
+    __atomic_sub_fetch(&q->sleepers, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&q->idle_lock);
 
     return msg;
 }
@@ -6,16 +6,29 @@
 #define QUEUE_PRIORITY_MAX ((size_t)-1)
 #define QUEUE_PRIORITY_MIN ((size_t)0)
 
+// Which directories a worker continues with, the deepest or the
+// shallowest of its own.  The priority of a message is its depth,
+// except for QUEUE_PRIORITY_MAX which always goes first.
+typedef enum { QUEUE_DEEP_FIRST, QUEUE_SHALLOW_FIRST } queue_order;
+
 typedef struct _message message;
 typedef struct _queue queue;
+typedef struct _deque deque;
 
+void message_init_global();
+void message_free_global();
 message *message_new(void *data, void (*freefn)(void *));
 void *message_data(message *msg);
 void message_free(message *msg);
 
-queue *queue_new();
+queue *queue_new(size_t nworkers);
 void queue_free(queue *q);
 void queue_put(queue *q, message *msg, size_t priority);
 void queue_put_head(queue *q, message *msg);
-void queue_put_tail(queue *q, message *msg);
-message *queue_get(queue *q);
+void queue_close(queue *q);
+void queue_set_order(queue *q, queue_order order);
+queue_order queue_get_order(queue *q);
+deque *queue_attach(queue *q);
+
+void deque_put(deque *d, message *msg, size_t priority);
+message *deque_get(deque *d);
@@ -0,0 +1,86 @@
+#include "outbuf.h"
+
+// C standard library
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <pthread.h>
+#include <unistd.h>
+
+// Thread-private output buffer
+//
+// Every thread collects its output in a private buffer which only
+// grows and is never flushed implicitly.  The owner decides when to
+// call outbuf_flush, which writes the whole buffer while holding a
+// process-wide lock, so output of different threads never interleaves
+// as long as flushes happen at record boundaries.
+
+#define OUTBUF_INITIAL_SIZE (64 * 1024)
+
+struct _outbuf {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t size;
+};
+
+static pthread_mutex_t outbuf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+outbuf *outbuf_new(int fd) {
+    outbuf *ob = (outbuf *)malloc(sizeof(outbuf));
+    ob->fd = fd;
+    ob->size = OUTBUF_INITIAL_SIZE;
+    ob->buf = (char *)malloc(ob->size * sizeof(char));
+    ob->len = 0;
+    return ob;
+}
+
+void outbuf_free(outbuf *ob) {
+    if (ob == NULL) {
+        return;
+    }
+    outbuf_flush(ob);
+    free(ob->buf);
+    free(ob);
+    ob = NULL;
+}
+
+void outbuf_append(outbuf *ob, const char *str, size_t len) {
+    if (__builtin_expect(ob->len + len > ob->size, 0)) {
+        while (ob->len + len > ob->size) {
+            ob->size *= 2;
+        }
+        ob->buf = (char *)realloc(ob->buf, ob->size * sizeof(char));
+    }
+    memcpy(ob->buf + ob->len, str, len);
+    ob->len += len;
+}
+
+void outbuf_putc(outbuf *ob, char c) { outbuf_append(ob, &c, 1); }
+
+size_t outbuf_length(outbuf *ob) { return ob->len; }
+
+void outbuf_flush(outbuf *ob) {
+    if (ob->len == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&outbuf_lock);
+    size_t off = 0;
+    while (off < ob->len) {
+        ssize_t n = write(ob->fd, ob->buf + off, ob->len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // There is nobody we could report to, drop the output
+            break;
+        }
+        off += (size_t)n;
+    }
+    pthread_mutex_unlock(&outbuf_lock);
+
+    ob->len = 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// C standard library
+#include <stddef.h>
+
+typedef struct _outbuf outbuf;
+
+outbuf *outbuf_new(int fd);
+void outbuf_free(outbuf *ob);
+void outbuf_append(outbuf *ob, const char *str, size_t len);
+void outbuf_putc(outbuf *ob, char c);
+size_t outbuf_length(outbuf *ob);
+void outbuf_flush(outbuf *ob);
@@ -0,0 +1,167 @@
+#include "pool.h"
+
+// C standard library
+#include <stdlib.h>
+
+// POSIX C library
+#include <pthread.h>
+
+// Fixed-size object pool
+//
+// Objects are carved from slabs and recycled through a free list per
+// thread, so allocating and releasing does not take a lock in the
+// common case.  A thread whose free list grows too long hands a batch
+// back to the shared depot from which the other threads refill
+// theirs.  The memory of the slabs is only returned by pool_free,
+// which must not be called before all other threads using the pool
+// have exited.
+
+#define POOL_ALIGN 16
+#define POOL_BATCH 64
+#define POOL_SLAB_OBJECTS 256
+
+typedef struct _pool_object pool_object;
+struct _pool_object {
+    pool_object *next;
+};
+
+typedef struct _slab slab;
+struct _slab {
+    slab *next;
+    char *data;
+};
+
+typedef struct {
+    pool *p;
+    pool_object *head;
+    size_t count;
+} pool_cache;
+
+struct _pool {
+    size_t size;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    pool_object *depot;
+    slab *slabs;
+};
+
+// Move up to n objects from the list *from to the list *to
+static size_t pool_move(pool_object **from, pool_object **to, size_t n) {
+    size_t moved = 0;
+    while (moved < n && *from != NULL) {
+        pool_object *obj = *from;
+        *from = obj->next;
+        obj->next = *to;
+        *to = obj;
+        ++moved;
+    }
+    return moved;
+}
+
+static void pool_cache_free(void *ptr) {
+    pool_cache *c = (pool_cache *)ptr;
+    pool *p = c->p;
+
+    pthread_mutex_lock(&p->lock);
+    pool_move(&c->head, &p->depot, c->count);
+    pthread_mutex_unlock(&p->lock);
+
+    free(c);
+}
+
+static pool_cache *pool_cache_get(pool *p) {
+    pool_cache *c = (pool_cache *)pthread_getspecific(p->key);
+    if (__builtin_expect(c == NULL, 0)) {
+        c = (pool_cache *)malloc(sizeof(pool_cache));
+        c->p = p;
+        c->head = NULL;
+        c->count = 0;
+        pthread_setspecific(p->key, c);
+    }
+    return c;
+}
+
+pool *pool_new(size_t size) {
+    pool *p = (pool *)malloc(sizeof(pool));
+    if (size < sizeof(pool_object)) {
+        size = sizeof(pool_object);
+    }
+    p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pthread_key_create(&p->key, pool_cache_free);
+    pthread_mutex_init(&p->lock, NULL);
+    p->depot = NULL;
+    p->slabs = NULL;
+    return p;
+}
+
+void pool_free(pool *p) {
+    if (p == NULL) {
+        return;
+    }
+
+    // The cache of the calling thread is not destroyed by the key
+    // destructor, so we free it here
+    pool_cache *c = (pool_cache *)pthread_getspecific(p->key);
+    if (c != NULL) {
+        pthread_setspecific(p->key, NULL);
+        free(c);
+    }
+    pthread_key_delete(p->key);
+
+    for (slab *s = p->slabs, *next = NULL; s != NULL; s = next) {
+        next = s->next;
+        free(s->data);
+        free(s);
+    }
+    pthread_mutex_destroy(&p->lock);
+    free(p);
+    p = NULL;
+}
+
+void *pool_alloc(pool *p) {
+    pool_cache *c = pool_cache_get(p);
+
+    if (__builtin_expect(c->head == NULL, 0)) {
+        // Refill from the depot or carve a new slab
+        pthread_mutex_lock(&p->lock);
+        if (p->depot != NULL) {
+            c->count += pool_move(&p->depot, &c->head, POOL_BATCH);
+        } else {
+            slab *s = (slab *)malloc(sizeof(slab));
+            s->data = (char *)malloc(POOL_SLAB_OBJECTS * p->size);
+            s->next = p->slabs;
+            p->slabs = s;
+            for (size_t i = 0; i < POOL_SLAB_OBJECTS; ++i) {
+                pool_object *obj = (pool_object *)(s->data + i * p->size);
+                obj->next = c->head;
+                c->head = obj;
+            }
+            c->count += POOL_SLAB_OBJECTS;
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    pool_object *obj = c->head;
+    c->head = obj->next;
+    --c->count;
+    return obj;
+}
+
+void pool_release(pool *p, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    pool_cache *c = pool_cache_get(p);
+    pool_object *obj = (pool_object *)ptr;
+    obj->next = c->head;
+    c->head = obj;
+    ++c->count;
+
+    // Give a batch back if the free list has grown too long
+    if (__builtin_expect(c->count > 2 * POOL_BATCH, 0)) {
+        pthread_mutex_lock(&p->lock);
+        c->count -= pool_move(&c->head, &p->depot, POOL_BATCH);
+        pthread_mutex_unlock(&p->lock);
+    }
+}
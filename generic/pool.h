@@ -0,0 +1,11 @@
+#pragma once
+
+// C standard library
+#include <stddef.h>
+
+typedef struct _pool pool;
+
+pool *pool_new(size_t size);
+void pool_free(pool *p);
+void *pool_alloc(pool *p);
+void pool_release(pool *p, void *obj);
@@ -0,0 +1,236 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "statxbatch.h"
+
+// C standard library
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Batches of statx through io_uring
+//
+// The requests for all names of a batch are queued in the submission
+// ring and handed to the kernel with a single system call, which works
+// on them concurrently.  The completions are processed as they arrive.
+// There is no dependency on liburing, the rings are set up with the
+// raw system calls.  If io_uring or its statx operation is not
+// available, statx_batch_new returns NULL and the caller looks up the
+// metadata one by one.  Because the kernel hands statx over to its
+// worker threads, this only pays off if those can run in parallel
+// with the traversal, so it is enabled with USE_IO_URING.
+#if defined(__linux__) && defined(USE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Number of requests in flight at a time
+#define STATX_BATCH_ENTRIES 256
+
+struct _statx_batch {
+    int fd;
+    unsigned entries;
+    // Set once a batch went wrong, because requests of it may still
+    // be in flight
+    bool broken;
+
+    // The submission and completion rings share one mapping
+    void *ring;
+    size_t ring_size;
+
+    // submission ring
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+
+    // completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct statx *bufs;
+};
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+// Whether the kernel knows the statx operation
+static bool supports_statx(int fd) {
+    size_t size =
+        sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, size);
+    bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE,
+                      probe, 256)
+                  == 0
+              && probe->last_op >= IORING_OP_STATX
+              && (probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+statx_batch *statx_batch_new() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = uring_setup(STATX_BATCH_ENTRIES, &p);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !supports_statx(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    statx_batch *b = (statx_batch *)malloc(sizeof(statx_batch));
+    b->fd = fd;
+    b->entries = p.sq_entries;
+    b->broken = false;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    b->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    b->ring = mmap(NULL, b->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    b->sqes = (struct io_uring_sqe *)mmap(
+        NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+        IORING_OFF_SQES);
+    if (b->ring == MAP_FAILED || b->sqes == MAP_FAILED) {
+        if (b->ring != MAP_FAILED) {
+            munmap(b->ring, b->ring_size);
+        }
+        if (b->sqes != MAP_FAILED) {
+            munmap(b->sqes, p.sq_entries * sizeof(struct io_uring_sqe));
+        }
+        close(fd);
+        free(b);
+        return NULL;
+    }
+
+    char *ring = (char *)b->ring;
+    b->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    b->sq_mask = (unsigned *)(ring + p.sq_off.ring_mask);
+    b->sq_array = (unsigned *)(ring + p.sq_off.array);
+    b->cq_head = (unsigned *)(ring + p.cq_off.head);
+    b->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    b->cq_mask = (unsigned *)(ring + p.cq_off.ring_mask);
+    b->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    b->bufs = (struct statx *)malloc(b->entries * sizeof(struct statx));
+    return b;
+}
+
+void statx_batch_free(statx_batch *b) {
+    if (b == NULL) {
+        return;
+    }
+    munmap(b->sqes, b->entries * sizeof(struct io_uring_sqe));
+    munmap(b->ring, b->ring_size);
+    close(b->fd);
+    free(b->bufs);
+    free(b);
+    b = NULL;
+}
+
+// Hand the completions to the callback, returning how many there were
+static size_t reap(statx_batch *b, size_t base, statx_batch_callback cb,
+                   void *ctx) {
+    size_t n = 0;
+    unsigned head = *b->cq_head;
+    unsigned tail = __atomic_load_n(b->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head, ++n) {
+        const struct io_uring_cqe *cqe = &b->cqes[head & *b->cq_mask];
+        size_t slot = (size_t)cqe->user_data;
+        cb(ctx, base + slot, cqe->res < 0 ? cqe->res : 0, &b->bufs[slot]);
+    }
+    __atomic_store_n(b->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Look up the metadata of the names relative to dirfd, with flags and
+// mask as for statx.  Returns false if the kernel refused the batch,
+// in which case the callback has been called for none or only some of
+// the names, and so are all further batches.
+bool statx_batch_run(statx_batch *b, int dirfd, const char *const *names,
+                     size_t n, int flags, unsigned mask,
+                     statx_batch_callback cb, void *ctx) {
+    if (b->broken) {
+        return false;
+    }
+    for (size_t base = 0; base < n; base += b->entries) {
+        size_t count = n - base < b->entries ? n - base : b->entries;
+
+        unsigned tail = *b->sq_tail;
+        for (size_t slot = 0; slot < count; ++slot, ++tail) {
+            unsigned index = tail & *b->sq_mask;
+            struct io_uring_sqe *sqe = &b->sqes[index];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = dirfd;
+            sqe->addr = (uint64_t)(uintptr_t)names[base + slot];
+            sqe->len = mask;
+            sqe->off = (uint64_t)(uintptr_t)&b->bufs[slot];
+            sqe->statx_flags = (uint32_t)flags;
+            sqe->user_data = slot;
+            b->sq_array[index] = index;
+        }
+        __atomic_store_n(b->sq_tail, tail, __ATOMIC_RELEASE);
+
+        // Submit everything at once, then wait for the completions and
+        // process each round of them as it comes in
+        size_t done = 0;
+        unsigned submit = (unsigned)count;
+        while (done < count) {
+            int rc = uring_enter(b->fd, submit, 1, IORING_ENTER_GETEVENTS);
+            if (rc < 0 && errno != EINTR) {
+                b->broken = true;
+                return false;
+            }
+            if (rc > 0) {
+                submit -= (unsigned)rc < submit ? (unsigned)rc : submit;
+            }
+            done += reap(b, base, cb, ctx);
+        }
+    }
+    return true;
+}
+
+#else
+
+statx_batch *statx_batch_new() { return NULL; }
+
+void statx_batch_free(statx_batch *b) { (void)b; }
+
+bool statx_batch_run(statx_batch *b, int dirfd, const char *const *names,
+                     size_t n, int flags, unsigned mask,
+                     statx_batch_callback cb, void *ctx) {
+    (void)b;
+    (void)dirfd;
+    (void)names;
+    (void)n;
+    (void)flags;
+    (void)mask;
+    (void)cb;
+    (void)ctx;
+    return false;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+struct statx;
+
+typedef struct _statx_batch statx_batch;
+
+// Called for every name as its result comes in, with the error as a
+// negative errno or 0 and the metadata
+typedef void (*statx_batch_callback)(void *ctx, size_t i, int res,
+                                     const struct statx *stx);
+
+statx_batch *statx_batch_new();
+void statx_batch_free(statx_batch *b);
+bool statx_batch_run(statx_batch *b, int dirfd, const char *const *names,
+                     size_t n, int flags, unsigned mask,
+                     statx_batch_callback cb, void *ctx);
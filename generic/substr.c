@@ -0,0 +1,203 @@
+#include "substr.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Substring search in file names
+//
+// File names are only a few bytes long, too short for memmem to make
+// up for its setup.  A case-sensitive search looks for the rarest byte
+// of the needle with memchr and compares from there.
+//
+// A case-insensitive search folds ASCII letters only.  It compares the
+// first and the last byte of the needle at every position of a block at
+// once (SSE2, or AVX2 if enabled at compile time) and only checks the
+// bytes in between where both match.  The haystack is copied into a
+// zero-padded buffer first, so that whole blocks can be loaded.  If the
+// haystack is not ASCII the search gives up, because Unicode case
+// folding maps some ASCII letters to other characters.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SUBSTR_SIMD
+#define SUBSTR_BLOCK 32
+typedef __m256i block;
+#define block_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define block_set1(c) _mm256_set1_epi8((char)(c))
+#define block_zero() _mm256_setzero_si256()
+#define block_or(a, b) _mm256_or_si256(a, b)
+#define block_and(a, b) _mm256_and_si256(a, b)
+#define block_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define block_mask(a) ((uint32_t)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define SUBSTR_SIMD
+#define SUBSTR_BLOCK 16
+typedef __m128i block;
+#define block_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define block_set1(c) _mm_set1_epi8((char)(c))
+#define block_zero() _mm_setzero_si128()
+#define block_or(a, b) _mm_or_si128(a, b)
+#define block_and(a, b) _mm_and_si128(a, b)
+#define block_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define block_mask(a) ((uint32_t)_mm_movemask_epi8(a))
+#endif
+
+// Longer haystacks are searched without copying them
+#define SUBSTR_MAX 256
+
+struct _substr {
+    // folded to lower case for a case-insensitive search
+    char *needle;
+    size_t len;
+    bool icase;
+    // position of the rarest byte of the needle
+    size_t rare;
+};
+
+// Bytes roughly ordered by how often they occur in file names
+static const char common_bytes[] = "etaoinsrlchdpmu.gfb_-yk0123456789wvx";
+
+static unsigned char fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+substr *substr_new(const char *needle, size_t len, bool icase) {
+    substr *s = (substr *)malloc(sizeof(substr));
+    s->needle = (char *)malloc((len + 1) * sizeof(char));
+    for (size_t i = 0; i < len; ++i) {
+        s->needle[i] = icase ? (char)fold((unsigned char)needle[i]) : needle[i];
+    }
+    s->needle[len] = '\0';
+    s->len = len;
+    s->icase = icase;
+
+    size_t best = sizeof(common_bytes);
+    s->rare = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const char *c = (const char *)memchr(common_bytes, s->needle[i],
+                                             sizeof(common_bytes) - 1);
+        size_t score =
+            c != NULL ? sizeof(common_bytes) - (size_t)(c - common_bytes) : 0;
+        if (score < best) {
+            best = score;
+            s->rare = i;
+        }
+    }
+    return s;
+}
+
+void substr_free(substr *s) {
+    if (s == NULL) {
+        return;
+    }
+    free(s->needle);
+    free(s);
+    s = NULL;
+}
+
+static int search_exact(const substr *s, const char *str, size_t len) {
+    if (s->len > len) {
+        return 0;
+    }
+    const size_t k = s->rare;
+    const char *end = str + len - s->len + k + 1;
+    for (const char *p = str + k;
+         (p = (const char *)memchr(p, s->needle[k], (size_t)(end - p)))
+         != NULL;
+         ++p) {
+        if (memcmp(p - k, s->needle, s->len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static bool equal_folded(const char *str, const char *needle, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if (fold((unsigned char)str[i]) != (unsigned char)needle[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int search_folded_scalar(const substr *s, const char *str,
+                                size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        if ((unsigned char)str[i] & 0x80) {
+            return -1;
+        }
+    }
+    for (size_t i = 0; i + s->len <= len; ++i) {
+        if (equal_folded(str + i, s->needle, s->len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+#ifdef SUBSTR_SIMD
+static bool is_letter(unsigned char c) {
+    return fold(c) >= 'a' && fold(c) <= 'z';
+}
+
+static int search_folded(const substr *s, const char *str, size_t len) {
+    if (len > SUBSTR_MAX) {
+        return search_folded_scalar(s, str, len);
+    }
+
+    // The padding is zero which never matches, because the needle is a
+    // C string
+    unsigned char buf[SUBSTR_MAX + SUBSTR_BLOCK]
+        __attribute__((aligned(SUBSTR_BLOCK)));
+    memcpy(buf, str, len);
+    memset(buf + len, 0, SUBSTR_BLOCK);
+
+    block any = block_zero();
+    for (size_t i = 0; i < len; i += SUBSTR_BLOCK) {
+        any = block_or(any, block_load(buf + i));
+    }
+    if (block_mask(any) != 0) {
+        return -1;
+    }
+    if (s->len > len) {
+        return 0;
+    }
+
+    // Letters are folded by setting their 0x20 bit, which may let some
+    // other characters through as well.  Those are sorted out by
+    // comparing the whole needle.
+    const unsigned char first = (unsigned char)s->needle[0];
+    const unsigned char last = (unsigned char)s->needle[s->len - 1];
+    const block f = block_set1(first);
+    const block l = block_set1(last);
+    const block f_fold = block_set1(is_letter(first) ? 0x20 : 0);
+    const block l_fold = block_set1(is_letter(last) ? 0x20 : 0);
+    for (size_t i = 0; i + s->len <= len; i += SUBSTR_BLOCK) {
+        block a = block_or(block_load(buf + i), f_fold);
+        block b = block_or(block_load(buf + i + s->len - 1), l_fold);
+        uint32_t bits = block_mask(block_and(block_eq(a, f), block_eq(b, l)));
+        while (bits != 0) {
+            size_t p = i + (size_t)__builtin_ctz(bits);
+            if (p + s->len <= len
+                && equal_folded((const char *)buf + p, s->needle, s->len)) {
+                return 1;
+            }
+            bits &= bits - 1;
+        }
+    }
+    return 0;
+}
+#else
+#define search_folded search_folded_scalar
+#endif
+
+// Returns 1 if the needle was found and 0 if not.  A case-insensitive
+// search returns -1 if the haystack is not ASCII.
+int substr_search(const substr *s, const char *str, size_t len) {
+    return s->icase ? search_folded(s, str, len) : search_exact(s, str, len);
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _substr substr;
+
+substr *substr_new(const char *needle, size_t len, bool icase);
+void substr_free(substr *s);
+int substr_search(const substr *s, const char *str, size_t len);
@@ -0,0 +1,669 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "glob.h"
+
+#include "substr.h"
+
+// C standard library
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// POSIX C library
+#include <fnmatch.h>
+
+// Glob patterns, compiled once
+//
+// A pattern behaves like fnmatch(3) without flags, or with FNM_CASEFOLD
+// if the case is ignored, and is matched against the name of an entry.
+// Patterns of the common shapes "name", "prefix*", "*suffix" and
+// "*infix*" are checked directly, all others are compiled into a list
+// of tokens.
+//
+// Bracket expressions are compiled into bitmaps by following fnmatch
+// through them for every byte, in the C locale, so that collating
+// symbols, equivalence classes and malformed brackets come out the way
+// fnmatch sees them.  The rare bracket which fnmatch ends in different
+// places for different bytes leaves the pattern to fnmatch itself.
+//
+// A pattern containing a slash is matched against the whole path
+// instead, where "*", "?" and brackets do not match a slash, "**/"
+// matches any number of directories and a trailing "/**" everything
+// inside a directory.  Unless it starts with a slash, such a pattern
+// may match any trailing part of the path, e.g. "src/*.c" matches
+// "./lib/src/foo.c".
+
+typedef enum {
+    TOKEN_BYTE,
+    TOKEN_ANY,
+    TOKEN_CLASS,
+    TOKEN_STAR,
+    // "**/", zero or more directories
+    TOKEN_GLOBSTAR,
+    // trailing "/**", everything inside the directory
+    TOKEN_REST,
+} token_kind;
+
+typedef struct {
+    unsigned char kind;
+    unsigned char byte;
+    uint16_t cls;
+} token;
+
+typedef enum {
+    SHAPE_EXACT,
+    SHAPE_PREFIX,
+    SHAPE_SUFFIX,
+    SHAPE_INFIX,
+    SHAPE_ANY,
+    SHAPE_GENERAL,
+    // like fnmatch, an invalid pattern matches nothing
+    SHAPE_NONE,
+    // a bracket expression fnmatch ends in different places, which is
+    // left to fnmatch itself
+    SHAPE_FNMATCH,
+} glob_shape;
+
+typedef struct {
+    glob_shape shape;
+    // matched against the whole path instead of the name
+    bool path;
+    // the pattern as given, for SHAPE_FNMATCH
+    char *pattern;
+    // bytes of the simple shapes, folded if the case is ignored
+    char *literal;
+    size_t l_literal;
+    substr *infix;
+    token *tokens;
+    size_t ntokens;
+    // bitmaps of the bracket expressions
+    uint8_t (*classes)[32];
+    size_t nclasses;
+} glob_part;
+
+struct _glob {
+    glob_part *parts;
+    size_t n;
+    bool icase;
+};
+
+static unsigned char fold(unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static void set_bit(uint8_t *bits, unsigned char c) {
+    bits[c >> 3] |= (uint8_t)(1 << (c & 7));
+}
+
+static bool test_bit(const uint8_t *bits, unsigned char c) {
+    return (bits[c >> 3] >> (c & 7)) & 1;
+}
+
+// Whether c is in the named class like [:alpha:] inside a bracket
+// expression.  Returns -1 for an unknown name.
+static int in_named(const char *name, size_t len, unsigned char c) {
+    static const struct {
+        const char *name;
+        int (*is)(int);
+    } named[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+        {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+        {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+        {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); ++i) {
+        if (strlen(named[i].name) == len
+            && memcmp(named[i].name, name, len) == 0) {
+            return named[i].is(c) != 0;
+        }
+    }
+    return -1;
+}
+
+// The character of a collating symbol like [.a.] at p, which points
+// behind the "[.".  Only single characters name themselves in the C
+// locale.  Returns -1 if the symbol is not closed or not known,
+// otherwise sets *end behind the ".]".
+static int collating_symbol(const char *p, const char **end) {
+    const char *q = p;
+    while (!(q[0] == '.' && q[1] == ']')) {
+        if (*q == '\0') {
+            return -1;
+        }
+        ++q;
+    }
+    if (q - p != 1) {
+        return -1;
+    }
+    *end = q + 2;
+    return (unsigned char)*p;
+}
+
+typedef enum {
+    BRACKET_OUT,
+    BRACKET_IN,
+    // the bracket is not closed and stands for itself
+    BRACKET_LITERAL,
+} bracket_result;
+
+// Skip the rest of a bracket expression after the element that
+// matched, as fnmatch does, and set *end behind it
+static bracket_result skip_bracket(const char *p, const char **end) {
+    unsigned char c;
+    do {
+        c = (unsigned char)*p++;
+        if (c == '\0') {
+            return BRACKET_LITERAL;
+        }
+        if (c == '\\') {
+            if (*p == '\0') {
+                return BRACKET_OUT;
+            }
+            ++p;
+        } else if (c == '[' && *p == ':') {
+            const char *q = p + 1;
+            while (*q >= 'a' && *q < 'z') {
+                ++q;
+            }
+            if (q[0] == ':' && q[1] == ']') {
+                p = q + 2;
+            }
+        } else if (c == '[' && *p == '=') {
+            if (p[1] == '\0' || p[2] != '=' || p[3] != ']') {
+                return BRACKET_OUT;
+            }
+            p += 4;
+        } else if (c == '[' && *p == '.') {
+            const char *q = p + 1;
+            while (!(q[0] == '.' && q[1] == ']')) {
+                if (*q == '\0') {
+                    return BRACKET_OUT;
+                }
+                ++q;
+            }
+            p = q + 2;
+        }
+    } while (c != ']');
+    *end = p;
+    return BRACKET_IN;
+}
+
+// Follow fnmatch in the C locale through the bracket expression at p
+// for the byte n.  If n is matched, *end is set to the rest of the
+// pattern.  fnmatch gives up on a malformed element once it gets there,
+// so only the bytes matched before it can match.
+static bracket_result bracket_byte(const char *p, unsigned char n,
+                                   bool icase, const char **end) {
+    unsigned char fn = icase ? fold(n) : n;
+    ++p;
+    bool negate = *p == '!' || *p == '^';
+    if (negate) {
+        ++p;
+    }
+    bool matched = false;
+    unsigned char c = (unsigned char)*p++;
+    for (;;) {
+        // The element is an ordinary character, possibly starting a
+        // range, unless it turns out to be something else
+        bool ordinary = true;
+        int sym = -1;
+        if (c == '\\') {
+            if (*p == '\0') {
+                return BRACKET_OUT;
+            }
+            c = (unsigned char)*p++;
+        } else if (c == '[' && *p == ':') {
+            const char *q = p + 1;
+            while (*q >= 'a' && *q < 'z') {
+                ++q;
+            }
+            if (q[0] == ':' && q[1] == ']') {
+                int in = in_named(p + 1, (size_t)(q - p - 1), n);
+                if (in < 0) {
+                    return BRACKET_OUT;
+                }
+                p = q + 2;
+                if (in) {
+                    matched = true;
+                    break;
+                }
+                ordinary = false;
+                c = (unsigned char)*p++;
+            }
+        } else if (c == '[' && *p == '=') {
+            if (p[1] != '\0' && p[2] == '=' && p[3] == ']') {
+                unsigned char equal = (unsigned char)p[1];
+                p += 4;
+                if (n == equal) {
+                    matched = true;
+                    break;
+                }
+                ordinary = false;
+                c = (unsigned char)*p++;
+            }
+        } else if (c == '\0') {
+            return BRACKET_LITERAL;
+        } else if (c == '[' && *p == '.') {
+            sym = collating_symbol(p + 1, &p);
+            if (sym < 0) {
+                return BRACKET_OUT;
+            }
+        }
+        if (!ordinary) {
+            if (c == ']') {
+                break;
+            }
+            continue;
+        }
+
+        unsigned char lo;
+        if (sym >= 0) {
+            lo = (unsigned char)sym;
+            if (!(*p == '-' && p[1] != '\0') && n == lo) {
+                matched = true;
+                break;
+            }
+        } else {
+            lo = icase ? fold(c) : c;
+            if (!(*p == '-' && p[1] != '\0' && p[1] != ']') && lo == fn) {
+                matched = true;
+                break;
+            }
+        }
+        c = (unsigned char)*p++;
+        if (c == '-' && *p != ']') {
+            unsigned char hi = (unsigned char)*p++;
+            bool escaped = hi == '\\';
+            if (escaped) {
+                hi = (unsigned char)*p++;
+            }
+            if (hi == '\0') {
+                return BRACKET_OUT;
+            }
+            if (!escaped && hi == '[' && *p == '.') {
+                sym = collating_symbol(p + 1, &p);
+                if (sym < 0) {
+                    return BRACKET_OUT;
+                }
+                hi = (unsigned char)sym;
+            } else if (icase) {
+                hi = fold(hi);
+            }
+            if (lo <= fn && fn <= hi) {
+                matched = true;
+                break;
+            }
+            c = (unsigned char)*p++;
+        }
+        if (c == ']') {
+            break;
+        }
+    }
+    if (!matched) {
+        if (!negate) {
+            return BRACKET_OUT;
+        }
+        *end = p;
+        return BRACKET_IN;
+    }
+    bracket_result skipped = skip_bracket(p, end);
+    return negate && skipped == BRACKET_IN ? BRACKET_OUT : skipped;
+}
+
+typedef enum {
+    BRACKET_CLASS,
+    // an unclosed bracket, which is an ordinary character
+    BRACKET_BYTE,
+    // nothing can match the bracket
+    BRACKET_EMPTY,
+    // fnmatch carries on at different places for different bytes
+    BRACKET_UNSURE,
+} bracket_kind;
+
+// Compile the bracket expression starting at p into a bitmap, byte by
+// byte as fnmatch would treat it.  Sets *end to the rest of the
+// pattern.
+static bracket_kind parse_bracket(const char *p, uint8_t *bits, bool icase,
+                                  bool path, const char **end) {
+    memset(bits, 0, 32);
+    *end = NULL;
+    bool literal = false;
+    for (unsigned c = 0; c < 256; ++c) {
+        const char *e = NULL;
+        switch (bracket_byte(p, (unsigned char)c, icase, &e)) {
+        case BRACKET_IN:
+            if (path && c == '/') {
+                break;
+            }
+            if (*end != NULL && *end != e) {
+                return BRACKET_UNSURE;
+            }
+            *end = e;
+            set_bit(bits, (unsigned char)c);
+            break;
+        case BRACKET_LITERAL:
+            literal = literal || c == '[';
+            break;
+        case BRACKET_OUT:
+            break;
+        }
+    }
+    if (literal) {
+        return *end == NULL ? BRACKET_BYTE : BRACKET_UNSURE;
+    }
+    return *end == NULL ? BRACKET_EMPTY : BRACKET_CLASS;
+}
+
+static void add_token(glob_part *g, token_kind kind, unsigned char byte) {
+    token *t = &g->tokens[g->ntokens++];
+    t->kind = (unsigned char)kind;
+    t->byte = byte;
+    t->cls = 0;
+}
+
+static void compile_tokens(glob_part *g, const char *pattern, bool icase) {
+    size_t len = strlen(pattern);
+    g->tokens = (token *)malloc((len + 1) * sizeof(token));
+    g->ntokens = 0;
+    g->shape = SHAPE_GENERAL;
+    g->classes = NULL;
+    g->nclasses = 0;
+
+    if (g->path && pattern[0] != '/') {
+        add_token(g, TOKEN_GLOBSTAR, 0);
+    }
+    for (const char *p = pattern; *p != '\0';) {
+        bool component = p == pattern || p[-1] == '/';
+        switch (*p) {
+        case '*':
+            if (g->path && component && p[1] == '*' && p[2] == '/') {
+                add_token(g, TOKEN_GLOBSTAR, 0);
+                p += 3;
+            } else if (g->path && component && p[1] == '*'
+                       && p[2] == '\0') {
+                add_token(g, TOKEN_REST, 0);
+                p += 2;
+            } else {
+                while (*p == '*') {
+                    ++p;
+                }
+                add_token(g, TOKEN_STAR, 0);
+            }
+            break;
+        case '?':
+            add_token(g, TOKEN_ANY, 0);
+            ++p;
+            break;
+        case '[': {
+            uint8_t bits[32];
+            const char *end;
+            bracket_kind kind = parse_bracket(p, bits, icase, g->path, &end);
+            if (kind == BRACKET_EMPTY) {
+                g->shape = SHAPE_NONE;
+                return;
+            }
+            if (kind == BRACKET_UNSURE) {
+                g->shape = SHAPE_FNMATCH;
+                return;
+            }
+            if (kind == BRACKET_BYTE) {
+                add_token(g, TOKEN_BYTE, '[');
+                ++p;
+                break;
+            }
+            g->classes = (uint8_t(*)[32])realloc(
+                g->classes, (g->nclasses + 1) * sizeof(*g->classes));
+            memcpy(g->classes[g->nclasses], bits, 32);
+            add_token(g, TOKEN_CLASS, 0);
+            g->tokens[g->ntokens - 1].cls = (uint16_t)g->nclasses++;
+            p = end;
+        } break;
+        case '\\':
+            if (p[1] == '\0') {
+                g->shape = SHAPE_NONE;
+                return;
+            }
+            ++p;
+            // fall through
+        default: {
+            unsigned char c = (unsigned char)*p++;
+            add_token(g, TOKEN_BYTE, icase ? fold(c) : c);
+        } break;
+        }
+    }
+}
+
+// Recognize the patterns which need no tokens to be matched
+static void classify(glob_part *g, bool icase) {
+    g->literal = NULL;
+    g->l_literal = 0;
+    g->infix = NULL;
+    if (g->path || g->shape != SHAPE_GENERAL) {
+        return;
+    }
+
+    size_t nstars = 0;
+    for (size_t i = 0; i < g->ntokens; ++i) {
+        if (g->tokens[i].kind == TOKEN_STAR) {
+            ++nstars;
+        } else if (g->tokens[i].kind != TOKEN_BYTE) {
+            return;
+        }
+    }
+    bool head = g->ntokens > 0 && g->tokens[0].kind == TOKEN_STAR;
+    bool tail =
+        g->ntokens > 0 && g->tokens[g->ntokens - 1].kind == TOKEN_STAR;
+    if (nstars == 0) {
+        g->shape = SHAPE_EXACT;
+    } else if (nstars == 1 && g->ntokens == 1) {
+        g->shape = SHAPE_ANY;
+    } else if (nstars == 1 && tail) {
+        g->shape = SHAPE_PREFIX;
+    } else if (nstars == 1 && head) {
+        g->shape = SHAPE_SUFFIX;
+    } else if (nstars == 2 && head && tail) {
+        g->shape = SHAPE_INFIX;
+    } else {
+        return;
+    }
+
+    g->literal = (char *)malloc((g->ntokens + 1) * sizeof(char));
+    for (size_t i = 0; i < g->ntokens; ++i) {
+        if (g->tokens[i].kind == TOKEN_BYTE) {
+            g->literal[g->l_literal++] = (char)g->tokens[i].byte;
+        }
+    }
+    g->literal[g->l_literal] = '\0';
+    if (g->shape == SHAPE_INFIX) {
+        g->infix = substr_new(g->literal, g->l_literal, icase);
+    }
+}
+
+glob *glob_compile(const char *const *patterns, size_t n, bool icase) {
+    glob *g = (glob *)malloc(sizeof(glob));
+    g->parts = (glob_part *)malloc(n * sizeof(glob_part));
+    g->n = n;
+    g->icase = icase;
+    for (size_t i = 0; i < n; ++i) {
+        glob_part *part = &g->parts[i];
+        part->path = strchr(patterns[i], '/') != NULL;
+        compile_tokens(part, patterns[i], icase);
+        part->pattern = part->shape == SHAPE_FNMATCH
+                            ? strdup(patterns[i])
+                            : NULL;
+        classify(part, icase);
+    }
+    return g;
+}
+
+void glob_free(glob *g) {
+    if (g == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < g->n; ++i) {
+        free(g->parts[i].pattern);
+        free(g->parts[i].literal);
+        substr_free(g->parts[i].infix);
+        free(g->parts[i].tokens);
+        free(g->parts[i].classes);
+    }
+    free(g->parts);
+    free(g);
+    g = NULL;
+}
+
+static bool equal(const char *str, const char *literal, size_t len,
+                  bool icase) {
+    if (!icase) {
+        return memcmp(str, literal, len) == 0;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        if (fold((unsigned char)str[i]) != (unsigned char)literal[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool token_matches(const glob_part *g, const token *t, unsigned char c,
+                          bool icase) {
+    switch (t->kind) {
+    case TOKEN_BYTE:
+        return (icase ? fold(c) : c) == t->byte;
+    case TOKEN_ANY:
+        return !g->path || c != '/';
+    case TOKEN_CLASS:
+        return test_bit(g->classes[t->cls], c);
+    }
+    return false;
+}
+
+// Match the tokens from k on against the string from i on.  A star
+// which has to match more is retried from the last one only, which is
+// enough as long as stars do not cross a slash that a token matched.
+static bool match_tokens(const glob_part *g, size_t k, const char *s,
+                         size_t i, size_t len, bool icase) {
+    size_t star_k = SIZE_MAX, star_i = 0;
+    for (;;) {
+        if (k < g->ntokens) {
+            const token *t = &g->tokens[k];
+            switch (t->kind) {
+            case TOKEN_GLOBSTAR:
+                if (match_tokens(g, k + 1, s, i, len, icase)) {
+                    return true;
+                }
+                for (size_t j = i; j < len; ++j) {
+                    if (s[j] == '/'
+                        && match_tokens(g, k + 1, s, j + 1, len, icase)) {
+                        return true;
+                    }
+                }
+                return false;
+            case TOKEN_REST:
+                return i < len;
+            case TOKEN_STAR:
+                star_k = k++;
+                star_i = i;
+                continue;
+            default:
+                if (i < len
+                    && token_matches(g, t, (unsigned char)s[i], icase)) {
+                    ++k;
+                    ++i;
+                    continue;
+                }
+                break;
+            }
+        } else if (i == len) {
+            return true;
+        }
+
+        // Let the last star match one more byte
+        if (star_k == SIZE_MAX || star_i == len
+            || (g->path && s[star_i] == '/')) {
+            return false;
+        }
+        i = ++star_i;
+        k = star_k + 1;
+    }
+}
+
+// A pattern containing a slash is tried on every trailing part of the
+// path, unless it starts with one.  fnmatch knows no "**", which is a
+// plain star here.
+static bool fnmatch_part(const glob_part *g, const char *path, size_t len,
+                         size_t namlen, bool icase) {
+    int flags = icase ? FNM_CASEFOLD : 0;
+    if (!g->path) {
+        return fnmatch(g->pattern, path + len - namlen, flags) == 0;
+    }
+    flags |= FNM_PATHNAME;
+    if (g->pattern[0] == '/') {
+        return fnmatch(g->pattern, path, flags) == 0;
+    }
+    for (const char *p = path; p != NULL; p = strchr(p, '/')) {
+        p += *p == '/';
+        if (fnmatch(g->pattern, p, flags) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool part_match(const glob_part *g, const char *path, size_t len,
+                       size_t namlen, bool icase) {
+    if (g->shape == SHAPE_NONE) {
+        return false;
+    }
+    if (g->shape == SHAPE_FNMATCH) {
+        return fnmatch_part(g, path, len, namlen, icase);
+    }
+    if (g->path) {
+        return match_tokens(g, 0, path, 0, len, icase);
+    }
+
+    const char *name = path + len - namlen;
+    const size_t l = g->l_literal;
+    switch (g->shape) {
+    case SHAPE_EXACT:
+        return namlen == l && equal(name, g->literal, l, icase);
+    case SHAPE_PREFIX:
+        return namlen >= l && equal(name, g->literal, l, icase);
+    case SHAPE_SUFFIX:
+        return namlen >= l && equal(name + namlen - l, g->literal, l, icase);
+    case SHAPE_INFIX: {
+        int found = substr_search(g->infix, name, namlen);
+        if (found >= 0) {
+            return found;
+        }
+        // Names which are not ASCII are folded just the same
+        return match_tokens(g, 0, name, 0, namlen, icase);
+    }
+    case SHAPE_ANY:
+        return true;
+    case SHAPE_GENERAL:
+    case SHAPE_NONE:
+    case SHAPE_FNMATCH:
+        break;
+    }
+    return match_tokens(g, 0, name, 0, namlen, icase);
+}
+
+// Index of the first pattern which matches the entry, or -1 if none
+// does.  The name is the last namlen bytes of the path.
+int glob_which(const glob *g, const char *path, size_t len, size_t namlen) {
+    for (size_t i = 0; i < g->n; ++i) {
+        if (part_match(&g->parts[i], path, len, namlen, g->icase)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+bool glob_match(const glob *g, const char *path, size_t len, size_t namlen) {
+    return glob_which(g, path, len, namlen) >= 0;
+}
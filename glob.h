@@ -0,0 +1,12 @@
+#pragma once
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct _glob glob;
+
+glob *glob_compile(const char *const *patterns, size_t n, bool icase);
+bool glob_match(const glob *g, const char *path, size_t len, size_t namlen);
+int glob_which(const glob *g, const char *path, size_t len, size_t namlen);
+void glob_free(glob *g);
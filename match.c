@@ -0,0 +1,269 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
+#include "match.h"
+
+#include "dircolors.h"
+#include "glob.h"
+
+// C standard library
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+// POSIX C library
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define outbuf_append_literal(ob, str) outbuf_append(ob, str, sizeof(str) - 1)
+
+// Fewer entries than this are looked up directly, because handing
+// them to the kernel threads costs more than it saves
+#define STATX_BATCH_MIN 8
+
+void process_match(outbuf *out, const char *real_path, size_t l_real_path,
+                   const char *dir_name, size_t l_dir_name,
+                   const char *base_name, int dirfd, unsigned char type,
+                   unsigned mode, size_t tag, const options *const opt) {
+    if (!limiter_take(opt->limit)) {
+        return;
+    }
+    if (opt->exec != NULL) {
+        exec_pool_submit(opt->exec, real_path, l_real_path);
+        return;
+    }
+    if (opt->tag) {
+        const char *pattern = opt->patterns[tag];
+        outbuf_append(out, pattern, strlen(pattern));
+        outbuf_putc(out, '\t');
+    }
+    if (opt->colorize) {
+        // A mode of 0 hasn't been looked up yet
+        const char *color =
+            mode != 0
+                ? dircolor_mode(base_name, mode)
+                : dircolor(dirfd, dirfd == AT_FDCWD ? real_path : base_name,
+                           type);
+        // A path from an index may have no directory part at all
+        if (base_name != real_path) {
+            outbuf_append_literal(out, DIRCOLOR_DIR);
+            outbuf_append(out, dir_name, l_dir_name);
+            outbuf_append_literal(out, "/" DIRCOLOR_RESET);
+        }
+        outbuf_append(out, color, strlen(color));
+        outbuf_append(out, base_name, l_real_path - l_dir_name - 1);
+        outbuf_append_literal(out, DIRCOLOR_RESET);
+    } else {
+        outbuf_append(out, real_path, l_real_path);
+    }
+    outbuf_putc(out, opt->delimiter);
+}
+
+// Apply the extension, type and pattern filters to a single entry, the
+// last d_namlen bytes of the path.  If results are tagged, tell which
+// of the patterns matched.
+bool match_entry(const char *path, size_t l_path, size_t d_namlen,
+                 unsigned char d_type, const options *const opt,
+                 // PCRE
+                 regex *re, regex_storage *mem,
+                 // TAG
+                 size_t *tag) {
+    const char *d_name = path + l_path - d_namlen;
+    *tag = 0;
+
+    // Filter by file extension (only files, directories never match)
+    if (opt->ext) {
+        if (d_type == DT_DIR) {
+            return false;
+        }
+        if (d_type == DT_REG) {
+            const char *ext = strrchr(d_name, '.');
+            if (ext == NULL || strcmp(ext + 1, opt->ext) != 0) {
+                return false;
+            }
+        }
+    }
+
+    // Filter by type
+    if (opt->only_type != DT_UNKNOWN && opt->only_type != d_type) {
+        return false;
+    }
+
+    // Perform the match
+    int which = 0;
+    switch (opt->mode) {
+    case REGEX:
+        if (!opt->tag) {
+            return regex_match(re, mem, d_name, d_namlen);
+        }
+        which = regex_which(re, mem, d_name, d_namlen);
+        break;
+    case GLOB:
+        if (!opt->tag) {
+            return glob_match(opt->match.gl, path, l_path, d_namlen);
+        }
+        which = glob_which(opt->match.gl, path, l_path, d_namlen);
+        break;
+    case NONE:
+        break;
+    }
+    if (which < 0) {
+        return false;
+    }
+    *tag = (size_t)which;
+    return true;
+}
+
+#ifdef STATX_BASIC_STATS
+// Set once statx turned out to be missing at run time, e.g. on an old
+// kernel or behind a seccomp filter, after which fstatat is used
+static bool statx_missing = false;
+
+// The fields statx has to fill in for the metadata filters, and the
+// mode for the colors if it is asked for
+static unsigned metadata_mask(const metadata_filter *f, bool mode) {
+    unsigned mask = mode ? STATX_MODE : 0;
+    mask |= (f->fields & META_SIZE) ? STATX_SIZE : 0;
+    mask |= (f->fields & META_MTIME) ? STATX_MTIME : 0;
+    mask |= (f->fields & META_OWNER) ? STATX_UID | STATX_GID : 0;
+    mask |= (f->fields & META_MODE) ? STATX_MODE : 0;
+    return mask;
+}
+#endif
+
+static bool metadata_pass(const metadata_filter *f, long long size,
+                          long long mtime, long long uid, long long gid,
+                          unsigned mode) {
+    if ((f->fields & META_SIZE)
+        && (size < f->min_size || size > f->max_size)) {
+        return false;
+    }
+    if ((f->fields & META_MTIME)
+        && (mtime < f->min_mtime || mtime > f->max_mtime)) {
+        return false;
+    }
+    if ((f->fields & META_OWNER)
+        && ((f->uid >= 0 && uid != f->uid) || (f->gid >= 0 && gid != f->gid))) {
+        return false;
+    }
+    if (f->fields & META_MODE) {
+        unsigned perm = mode & 07777;
+        switch (f->perm_match) {
+        case '-':
+            return (perm & f->perm) == f->perm;
+        case '/':
+            return (perm & f->perm) != 0;
+        default:
+            return perm == f->perm;
+        }
+    }
+    return true;
+}
+
+// Apply the metadata filters to the entry name relative to dirfd, as
+// for fstatat.  Only the fields the filters need are asked for, which
+// spares file systems like NFS the work of filling in the others.  If
+// mode isn't NULL, the mode is stored there for the colors, or 0 if
+// the entry couldn't be looked up.
+bool match_metadata(int dirfd, const char *name, unsigned *mode,
+                    const options *const opt) {
+    const metadata_filter *f = &opt->meta;
+    if (mode != NULL) {
+        *mode = 0;
+    }
+#ifdef STATX_BASIC_STATS
+    if (!__atomic_load_n(&statx_missing, __ATOMIC_RELAXED)) {
+        struct statx stx;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                  metadata_mask(f, mode != NULL), &stx)
+            == 0) {
+            if (mode != NULL) {
+                *mode = stx.stx_mode;
+            }
+            return metadata_pass(
+                f, (long long)stx.stx_size,
+                stx.stx_mtime.tv_sec * 1000000000LL + stx.stx_mtime.tv_nsec,
+                stx.stx_uid, stx.stx_gid, stx.stx_mode);
+        }
+        if (errno != ENOSYS) {
+            return f->fields == 0;
+        }
+        __atomic_store_n(&statx_missing, true, __ATOMIC_RELAXED);
+    }
+#endif
+    struct stat statbuf;
+    if (fstatat(dirfd, name, &statbuf, AT_SYMLINK_NOFOLLOW) != 0) {
+        return f->fields == 0;
+    }
+    if (mode != NULL) {
+        *mode = statbuf.st_mode;
+    }
+    return metadata_pass(
+        f, (long long)statbuf.st_size,
+        statbuf.st_mtim.tv_sec * 1000000000LL + statbuf.st_mtim.tv_nsec,
+        statbuf.st_uid, statbuf.st_gid, statbuf.st_mode);
+}
+
+#ifdef STATX_BASIC_STATS
+typedef struct {
+    const metadata_filter *f;
+    bool *pass;
+    unsigned *modes;
+} metadata_batch;
+
+static void metadata_done(void *ctx, size_t i, int res,
+                          const struct statx *stx) {
+    metadata_batch *mb = (metadata_batch *)ctx;
+    if (mb->modes != NULL) {
+        mb->modes[i] = res == 0 ? stx->stx_mode : 0;
+    }
+    if (res != 0) {
+        mb->pass[i] = mb->f->fields == 0;
+        return;
+    }
+    mb->pass[i] = metadata_pass(
+        mb->f, (long long)stx->stx_size,
+        stx->stx_mtime.tv_sec * 1000000000LL + stx->stx_mtime.tv_nsec,
+        stx->stx_uid, stx->stx_gid, stx->stx_mode);
+}
+#endif
+
+// Check the metadata of many entries of one directory at once and
+// store the results in pass, and the modes in modes unless it is NULL.
+// Without a batch, or if the kernel turns it down, the entries are
+// looked up one after another.
+void match_metadata_batch(statx_batch *b, int dirfd, const char *const *names,
+                          size_t n, bool *pass, unsigned *modes,
+                          const options *const opt) {
+#ifdef STATX_BASIC_STATS
+    if (b != NULL && n >= STATX_BATCH_MIN) {
+        metadata_batch mb = {&opt->meta, pass, modes};
+        if (statx_batch_run(b, dirfd, names, n,
+                            AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                            metadata_mask(&opt->meta, modes != NULL),
+                            metadata_done, &mb)) {
+            return;
+        }
+    }
+#else
+    (void)b;
+#endif
+    for (size_t i = 0; i < n; ++i) {
+        pass[i] = match_metadata(dirfd, names[i],
+                                 modes != NULL ? &modes[i] : NULL, opt);
+    }
+}
+
+// Print an entry which is known only by its full path, e.g. from an
+// index, whose colors have to be looked up by the whole path unless
+// its mode is already known
+void print_path(outbuf *out, const char *path, size_t len, unsigned char type,
+                unsigned mode, size_t tag, const options *const opt) {
+    const char *base_name = strrchr(path, '/');
+    base_name = base_name != NULL ? base_name + 1 : path;
+    size_t l_dir_name = base_name > path ? (size_t)(base_name - path) - 1 : 0;
+    process_match(out, path, len, path, l_dir_name, base_name, AT_FDCWD, type,
+                  mode, tag, opt);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "options.h"
+#include "outbuf.h"
+#include "regex.h"
+#include "statxbatch.h"
+
+// C standard library
+#include <stdbool.h>
+#include <stddef.h>
+
+void process_match(outbuf *out, const char *real_path, size_t l_real_path,
+                   const char *dir_name, size_t l_dir_name,
+                   const char *base_name, int dirfd, unsigned char type,
+                   unsigned mode, size_t tag, const options *const opt);
+void print_path(outbuf *out, const char *path, size_t len, unsigned char type,
+                unsigned mode, size_t tag, const options *const opt);
+bool match_metadata(int dirfd, const char *name, unsigned *mode,
+                    const options *const opt);
+void match_metadata_batch(statx_batch *b, int dirfd, const char *const *names,
+                          size_t n, bool *pass, unsigned *modes,
+                          const options *const opt);
+bool match_entry(const char *path, size_t l_path, size_t d_namlen,
+                 unsigned char d_type, const options *const opt,
+                 // PCRE
+                 regex *re, regex_storage *mem,
+                 // TAG
+                 size_t *tag);
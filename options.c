@@ -1,14 +1,23 @@
+#ifndef __cplusplus
+#define _GNU_SOURCE
+#endif
+
 #include "options.h"
 
 // C standard library
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // POSIX C library
 #include <dirent.h>
+#include <grp.h>
+#include <pwd.h>
 
 // GNU C library
 #include <getopt.h>
@@ -24,21 +33,65 @@ void print_usage(const char *msg) {
     fputs(
         // clang-format off
         "Usage: ff [FLAGS/OPTIONS] [<pattern>] [<path>...]\n"
+        "       ff [FLAGS/OPTIONS] -p <pattern>... [<path>...]\n"
         "Simplified version of GNU find using the PCRE library for regex.\n"
+        "Without a pattern every entry is listed, also with -g or -i.\n"
         "\n"
         "FLAGS:\n"
-        "  -g, --glob             Match glob instead of regex\n"
+        "  -g, --glob             Match glob instead of regex, a glob with a slash\n"
+        "                         against the path, where ** spans directories\n"
         "  -H, --hidden           Traverse hidden directories and files as well\n"
         "  -I, --no-ignore        Disregard .gitignore\n"
         "  -i, --ignore-case      Ignore case when applying the regex\n"
         "  -a, --absolute-path    Show full paths starting from root\n"
         "  -0, --print0           Separate search result by \\0\n"
+        "  -u, --unsorted         Print results as they are found without sorting\n"
+        "      --tag              Prefix every result with the pattern it matched\n"
         "  -h, --help             Display this help and quit\n"
         "\n"
         "OPTIONS:\n"
         "  -d, --max-depth <n>    Maximum directory traversal depth\n"
         "  -e, --extension <ext>  Filter by file extension\n"
         "  -j, --threads <n>      Use <n> threads for parallel directory traversal\n"
+        "      --schedule <policy>\n"
+        "                         Order of the traversal, one of\n"
+        "                             deep       deepest first (default).\n"
+        "                             shallow    shallowest first.\n"
+        "                             hybrid[:n] shallow until <n> results\n"
+        "                                        (100), then deep.\n"
+        "  -p, --pattern <pattern>\n"
+        "                         Match any of several patterns, may be repeated\n"
+        "      --max-results <n>  Stop after <n> results\n"
+        "      --timeout <time>   Stop searching after <time>, a duration like\n"
+        "                         500ms, 10s or 1m\n"
+        "      --build-index <file>\n"
+        "                         Index the paths instead of searching them\n"
+        "      --update-index <file>\n"
+        "                         Refresh the index, rereading changed directories\n"
+        "      --index <file>     Search the index file instead of the directories\n"
+        "      --daemon <socket>  Answer queries on <socket> from memory\n"
+        "      --connect <socket>\n"
+        "                         Ask the daemon listening on <socket>, or search\n"
+        "                         its paths if it lacks what -d, -H or -I ask for\n"
+        "  -x, --exec <cmd>...    Run <cmd> for every result, which replaces {} or\n"
+        "                         is appended, up to a ';' or the end\n"
+        "  -X, --exec-batch <cmd>...\n"
+        "                         Run <cmd> with as many results at once as fit\n"
+        "                         on the command line, which {} stands for\n"
+        "  -S, --size <[+-]n[kMGT]>\n"
+        "                         Restrict output to entries of at least (+), at\n"
+        "                         most (-) or exactly <n> bytes, KiB, ...\n"
+        "      --changed-within <time>\n"
+        "      --changed-before <time>\n"
+        "                         Restrict output to entries modified after or\n"
+        "                         before <time>, a duration like 10m, 2h, 1d, 3w\n"
+        "                         or a date like \"2024-01-31[ 12:00:00]\"\n"
+        "      --owner <user>[:<group>]\n"
+        "                         Restrict output to entries owned by <user>\n"
+        "                         and/or <group>, as names or ids\n"
+        "      --perm <[-/]mode>  Restrict output to entries whose octal\n"
+        "                         permissions are <mode>, include all (-) or any\n"
+        "                         (/) of its bits\n"
         "  -t, --type <x>         Restrict output to type with <x> one of\n"
         "                             b   block device.\n"
         "                             c   character device.\n"
@@ -51,6 +104,205 @@ void print_usage(const char *msg) {
         stdout);
 }
 
+// A size like 100, +1G or -10k, which adjusts the bounds of the filter
+static bool parse_size(const char *arg, metadata_filter *f) {
+    char sign = (arg[0] == '+' || arg[0] == '-') ? *arg++ : '=';
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || arg[0] == '-' || arg[0] == '+' || errno == ERANGE) {
+        return false;
+    }
+    int shift = 0;
+    switch (*end) {
+    case '\0':
+        break;
+    case 'k':
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case 'T':
+        shift = 40;
+        break;
+    default:
+        return false;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return false;
+    }
+    if (n > (unsigned long long)(LLONG_MAX >> shift)) {
+        return false;
+    }
+    long long size = (long long)(n << shift);
+    if (sign != '-' && size > f->min_size) {
+        f->min_size = size;
+    }
+    if (sign != '+' && size < f->max_size) {
+        f->max_size = size;
+    }
+    f->fields |= META_SIZE;
+    return true;
+}
+
+// A duration in nanoseconds like 500ms, 10 (seconds), 10m, 2h, 1d or 3w
+static bool parse_duration(const char *arg, long long *ns) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(arg, &end, 10);
+    if (end == arg || n < 0 || errno == ERANGE) {
+        return false;
+    }
+    long long unit = 0;
+    if (strcmp(end, "ms") == 0) {
+        unit = 1000000LL;
+    } else if (strcmp(end, "s") == 0 || *end == '\0') {
+        unit = 1000000000LL;
+    } else if (strcmp(end, "m") == 0 || strcmp(end, "min") == 0) {
+        unit = 60 * 1000000000LL;
+    } else if (strcmp(end, "h") == 0) {
+        unit = 60 * 60 * 1000000000LL;
+    } else if (strcmp(end, "d") == 0) {
+        unit = 24 * 60 * 60 * 1000000000LL;
+    } else if (strcmp(end, "w") == 0) {
+        unit = 7 * 24 * 60 * 60 * 1000000000LL;
+    } else {
+        return false;
+    }
+    if (n > LLONG_MAX / unit) {
+        return false;
+    }
+    *ns = n * unit;
+    return true;
+}
+
+// A point in time in nanoseconds since the epoch, given as a duration
+// back from now or as a date in local time
+static bool parse_time(const char *arg, long long *t) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *date = strptime(arg, "%Y-%m-%d", &tm);
+    if (date != NULL) {
+        if (*date == ' ' || *date == 'T') {
+            date = strptime(date + 1, "%H:%M:%S", &tm);
+        }
+        if (date == NULL || *date != '\0') {
+            return false;
+        }
+        tm.tm_isdst = -1;
+        *t = (long long)mktime(&tm) * 1000000000LL;
+        return true;
+    }
+
+    long long duration;
+    if (!parse_duration(arg, &duration)) {
+        return false;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *t = now.tv_sec * 1000000000LL + now.tv_nsec - duration;
+    return true;
+}
+
+// A traversal policy like deep, shallow or hybrid:50
+static bool parse_schedule(const char *arg, options *opt) {
+    if (strcmp(arg, "deep") == 0) {
+        opt->schedule = SCHEDULE_DEEP;
+        return true;
+    }
+    if (strcmp(arg, "shallow") == 0) {
+        opt->schedule = SCHEDULE_SHALLOW;
+        return true;
+    }
+    if (strncmp(arg, "hybrid", 6) != 0
+        || (arg[6] != '\0' && arg[6] != ':')) {
+        return false;
+    }
+    opt->schedule = SCHEDULE_HYBRID;
+    if (arg[6] == ':') {
+        char *end;
+        errno = 0;
+        unsigned long long n = strtoull(arg + 7, &end, 10);
+        if (end == arg + 7 || *end != '\0' || arg[7] == '-' || n == 0
+            || errno == ERANGE) {
+            return false;
+        }
+        opt->schedule_results = (size_t)n;
+    }
+    return true;
+}
+
+// A user or group id, or -1 if the name is unknown
+static long long parse_id(const char *name, bool group) {
+    char *end;
+    unsigned long id = strtoul(name, &end, 10);
+    if (end != name && *end == '\0') {
+        return (long long)id;
+    }
+    if (group) {
+        struct group *gr = getgrnam(name);
+        return gr != NULL ? (long long)gr->gr_gid : -1;
+    }
+    struct passwd *pw = getpwnam(name);
+    return pw != NULL ? (long long)pw->pw_uid : -1;
+}
+
+// An owner like user, user:group or :group
+static bool parse_owner(const char *arg, metadata_filter *f) {
+    const char *colon = strchr(arg, ':');
+    size_t l_user = colon != NULL ? (size_t)(colon - arg) : strlen(arg);
+    if (l_user > 0) {
+        char *user = strndup(arg, l_user);
+        f->uid = parse_id(user, false);
+        free(user);
+        if (f->uid < 0) {
+            return false;
+        }
+    }
+    if (colon != NULL && colon[1] != '\0') {
+        if ((f->gid = parse_id(colon + 1, true)) < 0) {
+            return false;
+        }
+    }
+    f->fields |= META_OWNER;
+    return f->uid >= 0 || f->gid >= 0;
+}
+
+// Permissions like 644, -600 or /111
+static bool parse_perm(const char *arg, metadata_filter *f) {
+    f->perm_match = (arg[0] == '-' || arg[0] == '/') ? *arg++ : '=';
+    char *end;
+    unsigned long perm = strtoul(arg, &end, 8);
+    if (end == arg || *end != '\0' || perm > 07777) {
+        return false;
+    }
+    f->perm = (unsigned)perm;
+    f->fields |= META_MODE;
+    return true;
+}
+
+// Long options without a short equivalent
+enum {
+    OPTION_BUILD_INDEX = 256,
+    OPTION_UPDATE_INDEX,
+    OPTION_INDEX,
+    OPTION_DAEMON,
+    OPTION_CONNECT,
+    OPTION_TAG,
+    OPTION_CHANGED_WITHIN,
+    OPTION_CHANGED_BEFORE,
+    OPTION_OWNER,
+    OPTION_PERM,
+    OPTION_MAX_RESULTS,
+    OPTION_TIMEOUT,
+    OPTION_SCHEDULE,
+};
+
 int ff_parse_options(int argc, char *argv[], options *opt) {
     int option_index = 0;
     static struct option long_options[] = {
@@ -60,17 +312,65 @@ int ff_parse_options(int argc, char *argv[], options *opt) {
         {"hidden", no_argument, NULL, 'H'},
         {"no-ignore", no_argument, NULL, 'I'},
         {"ignore-case", no_argument, NULL, 'i'},
+        {"unsorted", no_argument, NULL, 'u'},
+        {"tag", no_argument, NULL, OPTION_TAG},
         {"help", no_argument, NULL, 'h'},
         // Options
         {"max-depth", required_argument, NULL, 'd'},
         {"extension", required_argument, NULL, 'e'},
         {"threads", required_argument, NULL, 'j'},
+        {"pattern", required_argument, NULL, 'p'},
         {"type", required_argument, NULL, 't'},
+        {"size", required_argument, NULL, 'S'},
+        {"changed-within", required_argument, NULL, OPTION_CHANGED_WITHIN},
+        {"changed-before", required_argument, NULL, OPTION_CHANGED_BEFORE},
+        {"owner", required_argument, NULL, OPTION_OWNER},
+        {"perm", required_argument, NULL, OPTION_PERM},
+        {"max-results", required_argument, NULL, OPTION_MAX_RESULTS},
+        {"timeout", required_argument, NULL, OPTION_TIMEOUT},
+        {"schedule", required_argument, NULL, OPTION_SCHEDULE},
+        {"build-index", required_argument, NULL, OPTION_BUILD_INDEX},
+        {"update-index", required_argument, NULL, OPTION_UPDATE_INDEX},
+        {"index", required_argument, NULL, OPTION_INDEX},
+        {"daemon", required_argument, NULL, OPTION_DAEMON},
+        {"connect", required_argument, NULL, OPTION_CONNECT},
         // Sentinel
         {NULL, 0, NULL, 0}};
 
+    // Everything after --exec or --exec-batch up to a ';' is the
+    // command, which is taken out before the options are parsed
+    for (int arg = 1; arg < argc && strcmp(argv[arg], "--") != 0; ++arg) {
+        bool batch = strcmp(argv[arg], "-X") == 0
+                     || strcmp(argv[arg], "--exec-batch") == 0;
+        if (!batch && strcmp(argv[arg], "-x") != 0
+            && strcmp(argv[arg], "--exec") != 0) {
+            continue;
+        }
+        int end = arg + 1;
+        while (end < argc && strcmp(argv[end], ";") != 0) {
+            ++end;
+        }
+        if (end == arg + 1) {
+            print_usage("--exec and --exec-batch need a command");
+            return OPTIONS_FAILURE;
+        }
+        opt->exec_batch = batch;
+        opt->exec_argc = (size_t)(end - arg - 1);
+        opt->exec_argv = (char **)malloc(opt->exec_argc * sizeof(char *));
+        memcpy(opt->exec_argv, argv + arg + 1,
+               opt->exec_argc * sizeof(char *));
+
+        int skip = end - arg + (end < argc);
+        memmove(argv + arg, argv + arg + skip,
+                (size_t)(argc - arg - skip) * sizeof(char *));
+        argc -= skip;
+        argv[argc] = NULL;
+        break;
+    }
+    opt->argc = argc;
+
     int c = -1;
-    while ((c = getopt_long(argc, argv, "d:e:t:j:0agHiIDh", long_options,
+    while ((c = getopt_long(argc, argv, "d:e:t:j:p:S:0agHiIuDh", long_options,
                             &option_index)) != -1) {
         switch (c) {
         // Flags
@@ -92,6 +392,12 @@ int ff_parse_options(int argc, char *argv[], options *opt) {
         case 'i':
             opt->icase = true;
             break;
+        case 'u':
+            opt->unsorted = true;
+            break;
+        case OPTION_TAG:
+            opt->tag = true;
+            break;
         case 'h':
             print_usage(NULL);
             return OPTIONS_HELP;
@@ -116,6 +422,99 @@ int ff_parse_options(int argc, char *argv[], options *opt) {
                 return OPTIONS_FAILURE;
             }
             break;
+        case 'p':
+            assert(optarg);
+            opt->patterns = (const char **)realloc(
+                opt->patterns, (opt->npatterns + 1) * sizeof(char *));
+            opt->patterns[opt->npatterns++] = optarg;
+            break;
+        case 'S':
+            assert(optarg);
+            if (!parse_size(optarg, &opt->meta)) {
+                print_usage("Invalid argument for --size");
+                return OPTIONS_FAILURE;
+            }
+            break;
+        case OPTION_CHANGED_WITHIN:
+        case OPTION_CHANGED_BEFORE: {
+            assert(optarg);
+            long long t;
+            if (!parse_time(optarg, &t)) {
+                print_usage("Invalid argument for --changed-within or "
+                            "--changed-before");
+                return OPTIONS_FAILURE;
+            }
+            if (c == OPTION_CHANGED_WITHIN && t > opt->meta.min_mtime) {
+                opt->meta.min_mtime = t;
+            } else if (c == OPTION_CHANGED_BEFORE && t < opt->meta.max_mtime) {
+                opt->meta.max_mtime = t;
+            }
+            opt->meta.fields |= META_MTIME;
+        } break;
+        case OPTION_OWNER:
+            assert(optarg);
+            if (!parse_owner(optarg, &opt->meta)) {
+                print_usage("Invalid argument for --owner");
+                return OPTIONS_FAILURE;
+            }
+            break;
+        case OPTION_PERM:
+            assert(optarg);
+            if (!parse_perm(optarg, &opt->meta)) {
+                print_usage("Invalid argument for --perm");
+                return OPTIONS_FAILURE;
+            }
+            break;
+        case OPTION_MAX_RESULTS: {
+            assert(optarg);
+            char *end;
+            errno = 0;
+            opt->max_results = (size_t)strtoull(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || optarg[0] == '-'
+                || opt->max_results == 0 || errno == ERANGE) {
+                print_usage("Invalid argument for --max-results");
+                return OPTIONS_FAILURE;
+            }
+        } break;
+        case OPTION_TIMEOUT:
+            assert(optarg);
+            if (!parse_duration(optarg, &opt->timeout) || opt->timeout == 0) {
+                print_usage("Invalid argument for --timeout");
+                return OPTIONS_FAILURE;
+            }
+            break;
+        case OPTION_SCHEDULE:
+            assert(optarg);
+            if (!parse_schedule(optarg, opt)) {
+                print_usage("Invalid argument for --schedule");
+                return OPTIONS_FAILURE;
+            }
+            break;
+        case OPTION_BUILD_INDEX:
+            assert(optarg);
+            opt->index = INDEX_BUILD;
+            opt->index_file = optarg;
+            break;
+        case OPTION_UPDATE_INDEX:
+            assert(optarg);
+            opt->index = INDEX_UPDATE;
+            opt->index_file = optarg;
+            break;
+        case OPTION_INDEX:
+            assert(optarg);
+            opt->index = INDEX_QUERY;
+            opt->index_file = optarg;
+            break;
+        case OPTION_DAEMON:
+            assert(optarg);
+            opt->daemon = DAEMON_SERVE;
+            opt->socket_path = optarg;
+            break;
+        case OPTION_CONNECT:
+            assert(optarg);
+            opt->daemon = DAEMON_CONNECT;
+            opt->socket_path = optarg;
+            break;
         case 't':
             assert(optarg && strlen(optarg) > 0);
             switch (optarg[0]) {
@@ -151,18 +550,52 @@ int ff_parse_options(int argc, char *argv[], options *opt) {
         }
     }
 
-    // Scan pattern and directory
-    const char *pattern = "";
-    switch (argc - optind) {
-    case 0:
+    // Scan pattern and directory.  An index or a daemon records every
+    // entry, so building one takes only directories and updating an
+    // index nothing.  Patterns given by --pattern leave all arguments
+    // to be directories.
+    if (opt->index == INDEX_UPDATE && optind < argc) {
+        print_usage("--update-index does not take a pattern or paths");
+        return OPTIONS_FAILURE;
+    }
+    if ((opt->index == INDEX_BUILD || opt->index == INDEX_UPDATE
+         || opt->daemon == DAEMON_SERVE)
+        && opt->exec_argv != NULL) {
+        print_usage("--exec does not go with building an index or --daemon");
+        return OPTIONS_FAILURE;
+    }
+    if ((opt->index == INDEX_BUILD || opt->index == INDEX_UPDATE
+         || opt->daemon == DAEMON_SERVE)
+        && (opt->max_results > 0 || opt->timeout > 0)) {
+        print_usage("--max-results and --timeout do not go with building an "
+                    "index or --daemon");
+        return OPTIONS_FAILURE;
+    }
+    if ((opt->index == INDEX_BUILD || opt->daemon == DAEMON_SERVE)
+        && opt->npatterns > 0) {
+        print_usage("--build-index and --daemon do not take a pattern");
+        return OPTIONS_FAILURE;
+    }
+    if (opt->npatterns == 0 && opt->index != INDEX_BUILD
+        && opt->daemon != DAEMON_SERVE && optind < argc) {
+        opt->patterns = (const char **)malloc(sizeof(char *));
+        opt->patterns[opt->npatterns++] = argv[optind++];
+    }
+    if (opt->npatterns == 0) {
         opt->mode = NONE;
-        break;
-    default:
-        pattern = argv[optind++];
-        if (strlen(pattern) > 0 && opt->mode == NONE) {
-            opt->mode = REGEX;
-        }
-        break;
+        opt->tag = false;
+    } else if (opt->mode == NONE
+               && (opt->npatterns > 1 || strlen(opt->patterns[0]) > 0)) {
+        opt->mode = REGEX;
+    }
+
+    if (opt->index == INDEX_QUERY && optind < argc) {
+        print_usage("--index does not take any paths");
+        return OPTIONS_FAILURE;
+    }
+    if (opt->daemon == DAEMON_CONNECT && optind < argc) {
+        print_usage("--connect does not take any paths");
+        return OPTIONS_FAILURE;
     }
 
     for (int arg = optind; arg < argc; ++arg) {
@@ -187,10 +620,12 @@ int ff_parse_options(int argc, char *argv[], options *opt) {
     switch (opt->mode) {
     case REGEX: {
         // Compile pattern
-        opt->match.re = regex_compile(pattern, opt->icase);
+        opt->match.re =
+            regex_compile(opt->patterns, opt->npatterns, opt->icase);
     } break;
     case GLOB:
-        opt->match.pattern = pattern;
+        opt->match.gl =
+            glob_compile(opt->patterns, opt->npatterns, opt->icase);
         break;
     case NONE:
         break;
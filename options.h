@@ -1,40 +1,116 @@
 #pragma once
 
+#include "exec.h"
+#include "fileindex.h"
 #include "flagman.h"
+#include "glob.h"
+#include "limiter.h"
 #include "message.h"
 #include "regex.h"
 
 // C standard library
 #include <stdbool.h>
+#include <stddef.h>
 
 // PCRE
 #include <pcre.h>
 
 typedef enum { NONE, GLOB, REGEX } match_mode;
 
+typedef enum {
+    INDEX_NONE,
+    INDEX_BUILD,
+    INDEX_UPDATE,
+    INDEX_QUERY
+} index_mode;
+
+typedef enum { DAEMON_NONE, DAEMON_SERVE, DAEMON_CONNECT } daemon_mode;
+
+// Order of the traversal, the hybrid goes shallow first until some
+// results are out and deep first from then on
+typedef enum {
+    SCHEDULE_DEEP,
+    SCHEDULE_SHALLOW,
+    SCHEDULE_HYBRID
+} schedule_policy;
+
+// Parts of the metadata the filters need
+enum {
+    META_SIZE = 0x1,
+    META_MTIME = 0x2,
+    META_OWNER = 0x4,
+    META_MODE = 0x8,
+};
+
+// Filters on the metadata of an entry, which is only looked up for
+// entries passing all other filters
+typedef struct {
+    unsigned fields;
+    // inclusive bounds, in bytes and nanoseconds since the epoch
+    long long min_size;
+    long long max_size;
+    long long min_mtime;
+    long long max_mtime;
+    // -1 for anyone
+    long long uid;
+    long long gid;
+    // the permission bits have to be exactly these ('='), include all
+    // of them ('-'), or any of them ('/')
+    unsigned perm;
+    char perm_match;
+} metadata_filter;
+
 typedef struct {
     queue *q;
     flagman *flagman_lock;
+    // raised once enough results are out or the time is up
+    limiter *limit;
 
     // tagged union
     union {
         regex *re;
-        const char *pattern;
+        glob *gl;
     } match;
     match_mode mode;
+    // an entry matching any of the patterns is a result
+    const char **patterns;
+    size_t npatterns;
 
     // program parameters
     int optind;
+    // arguments left once the command to execute is taken out
+    int argc;
     unsigned char only_type;
+    metadata_filter meta;
     bool skip_hidden;
     long max_depth;
     bool colorize;
+    bool line_buffered;
     bool icase;
     bool no_ignore;
     long nthreads;
+    long max_open_dirs;
+    schedule_policy schedule;
+    size_t schedule_results;
     const char *ext;
     char delimiter;
     bool absolute;
+    bool unsorted;
+    bool tag;
+    index_mode index;
+    const char *index_file;
+    // directories of the index being updated
+    fileindex_dirs *previous;
+    daemon_mode daemon;
+    const char *socket_path;
+    // command to run for the results instead of printing them
+    char **exec_argv;
+    size_t exec_argc;
+    bool exec_batch;
+    exec_pool *exec;
+    // 0 for no limit, the timeout in nanoseconds
+    size_t max_results;
+    long long timeout;
 } options;
 
 enum {
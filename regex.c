@@ -1,10 +1,14 @@
 #include "regex.h"
 
+#include "ahocorasick.h"
+#include "substr.h"
+
 // C standard library
 #include <assert.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef USE_POSIX_REGEX
 // POSIX C library
@@ -15,24 +19,68 @@
 #endif
 
 struct _regex {
+    // If the pattern is a plain string, it is searched for directly
+    // instead of going through the regex engine
+    substr *literal;
+    // Several plain strings are searched for all at once
+    ahocorasick *literals;
+    // Whether the regex engine was compiled.  A case-insensitive literal
+    // still needs it for names which are not ASCII.
+    bool engine;
 #ifdef USE_POSIX_REGEX
     regex_t re;
 #else
+    // The pattern is compiled to machine code once and shared by all
+    // threads, which only need a stack of their own to run it
     pcre *re;
+    pcre_extra *extra;
 #endif
+    // Several patterns are also compiled one by one, to tell which of
+    // them matched
+    regex **parts;
+    size_t nparts;
 };
 
 #ifdef USE_POSIX_REGEX
 typedef void _regex_storage;
 #else
 struct _regex_storage {
-    pcre_extra *extra;
     pcre_jit_stack *jit_stack;
+    regex_storage **parts;
+    size_t nparts;
 };
 #endif
 
-regex *regex_compile(const char *pattern, bool icase) {
+// Whether the pattern has none of the characters which are special
+// in PCRE or POSIX extended regex
+static bool is_literal(const char *pattern) {
+    return pattern[0] != '\0'
+           && pattern[strcspn(pattern, "\\^$.|?*+()[]{}")] == '\0';
+}
+
+static bool is_ascii(const char *pattern) {
+    for (const char *p = pattern; *p != '\0'; ++p) {
+        if ((unsigned char)*p & 0x80) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static regex *regex_new() {
     regex *re = (regex *)malloc(sizeof(regex));
+    re->literal = NULL;
+    re->literals = NULL;
+    re->engine = false;
+    re->parts = NULL;
+    re->nparts = 0;
+    return re;
+}
+
+// Compile the pattern with the regex engine, describing the error in
+// error unless it is NULL
+static bool compile_engine(regex *re, const char *pattern, bool icase,
+                           char *error) {
 #ifdef USE_POSIX_REGEX
     int flags = REG_EXTENDED;
     if (icase) {
@@ -42,10 +90,11 @@ regex *regex_compile(const char *pattern, bool icase) {
     char errbuf[256];
     int rc = regcomp(&re->re, pattern, flags);
     if (rc != 0) {
-        regerror(rc, &re->re, errbuf, 256);
-        fprintf(stderr, "Invalid regex: %s\n", errbuf);
-        regex_free(re);
-        exit(1);
+        if (error != NULL) {
+            regerror(rc, &re->re, errbuf, 256);
+            snprintf(error, REGEX_ERROR_SIZE, "Invalid regex: %s", errbuf);
+        }
+        return false;
     }
 #else
     int flags = PCRE_UCP | PCRE_UTF8;
@@ -53,19 +102,124 @@ regex *regex_compile(const char *pattern, bool icase) {
         flags |= PCRE_CASELESS;
     }
 
-    const char *error;
+    const char *msg;
     int erroffset;
-    re->re = pcre_compile(pattern, flags, &error, &erroffset, NULL);
+    re->re = pcre_compile(pattern, flags, &msg, &erroffset, NULL);
     if (re->re == NULL) {
-        fprintf(stderr, "Invalid regex: %s at %d\n", error, erroffset);
+        if (error != NULL) {
+            snprintf(error, REGEX_ERROR_SIZE, "Invalid regex: %s at %d", msg,
+                     erroffset);
+        }
+        return false;
+    }
+    re->extra = pcre_study(re->re, PCRE_STUDY_JIT_COMPILE, &msg);
+    assert(re->extra != NULL);
+#endif
+    re->engine = true;
+    return true;
+}
+
+// Number of capturing groups of the pattern
+static size_t groups(const regex *re) {
+    if (!re->engine) {
+        return 0;
+    }
+#ifdef USE_POSIX_REGEX
+    return re->re.re_nsub;
+#else
+    int count = 0;
+    pcre_fullinfo(re->re, NULL, PCRE_INFO_CAPTURECOUNT, &count);
+    return (size_t)count;
+#endif
+}
+
+static regex *compile_one(const char *pattern, bool icase, char *error) {
+    regex *re = regex_new();
+    if (is_literal(pattern) && (!icase || is_ascii(pattern))) {
+        re->literal = substr_new(pattern, strlen(pattern), icase);
+        if (!icase) {
+            return re;
+        }
+    }
+    if (!compile_engine(re, pattern, icase, error)) {
         regex_free(re);
-        exit(1);
+        return NULL;
+    }
+    return re;
+}
+
+// Several patterns are combined into one, so that every name is read
+// only once.  Plain strings go into a single automaton, other patterns
+// are joined into an alternation for the regex engine.  The latter is
+// only safe if none of them refers to a group by number, i.e. has any
+// groups, or recurses into the whole pattern.
+static void compile_set(regex *re, const char *const *patterns, size_t n,
+                        bool icase) {
+    bool literals = true, combine = true;
+    size_t len = 0;
+    for (size_t i = 0; i < n; ++i) {
+        literals = literals && re->parts[i]->literal != NULL;
+        combine = combine && groups(re->parts[i]) == 0
+                  && strstr(patterns[i], "(?R") == NULL;
+        len += strlen(patterns[i]) + sizeof("(?:)|");
     }
+
+    if (literals) {
+        re->literals = ahocorasick_new(patterns, n, icase);
+        return;
+    }
+    if (!combine) {
+        return;
+    }
+
+    char *combined = (char *)malloc(len * sizeof(char));
+    char *p = combined;
+    for (size_t i = 0; i < n; ++i) {
+#ifdef USE_POSIX_REGEX
+        p += sprintf(p, i > 0 ? "|(%s)" : "(%s)", patterns[i]);
+#else
+        p += sprintf(p, i > 0 ? "|(?:%s)" : "(?:%s)", patterns[i]);
 #endif
+    }
+    compile_engine(re, combined, icase, NULL);
+    free(combined);
+}
+
+// Describe an invalid pattern in error, which has room for
+// REGEX_ERROR_SIZE bytes, and return NULL
+regex *regex_try_compile(const char *const *patterns, size_t n, bool icase,
+                         char *error) {
+    assert(n > 0);
+    if (n == 1) {
+        return compile_one(patterns[0], icase, error);
+    }
+
+    regex *re = regex_new();
+    re->parts = (regex **)calloc(n, sizeof(regex *));
+    re->nparts = n;
+    for (size_t i = 0; i < n; ++i) {
+        if ((re->parts[i] = compile_one(patterns[i], icase, error))
+            == NULL) {
+            regex_free(re);
+            return NULL;
+        }
+    }
+    compile_set(re, patterns, n, icase);
     return re;
 }
 
-bool regex_match(regex *re, regex_storage *mem, const char *str, int len) {
+regex *regex_compile(const char *const *patterns, size_t n, bool icase) {
+    char error[REGEX_ERROR_SIZE];
+    regex *re = regex_try_compile(patterns, n, icase, error);
+    if (re == NULL) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    return re;
+}
+
+static bool engine_match(regex *re, regex_storage *mem, const char *str,
+                         int len) {
 #ifdef USE_POSIX_REGEX
     (void)mem;
     (void)len;
@@ -74,7 +228,7 @@ bool regex_match(regex *re, regex_storage *mem, const char *str, int len) {
     }
 #else
     int ovector[3];
-    if (pcre_jit_exec(re->re, mem->extra, str, len, 0, 0, ovector, 3,
+    if (pcre_jit_exec(re->re, re->extra, str, len, 0, 0, ovector, 3,
                       mem->jit_stack) > 0) {
         return true;
     }
@@ -82,14 +236,71 @@ bool regex_match(regex *re, regex_storage *mem, const char *str, int len) {
     return false;
 }
 
+static regex_storage *part_storage(regex_storage *mem, size_t i) {
+#ifdef USE_POSIX_REGEX
+    (void)mem;
+    (void)i;
+    return NULL;
+#else
+    return mem->parts[i];
+#endif
+}
+
+// Index of the first pattern which matches, or -1 if none does
+int regex_which(regex *re, regex_storage *mem, const char *str, int len) {
+    if (re->nparts == 0) {
+        return regex_match(re, mem, str, len) ? 0 : -1;
+    }
+
+    // Only a match of the combined pattern needs to be attributed
+    if (re->literals != NULL) {
+        int found = ahocorasick_search(re->literals, str, (size_t)len);
+        if (found != AHOCORASICK_NOT_ASCII) {
+            return found < 0 ? -1 : found;
+        }
+    } else if (re->engine && !engine_match(re, mem, str, len)) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < re->nparts; ++i) {
+        if (regex_match(re->parts[i], part_storage(mem, i), str, len)) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+bool regex_match(regex *re, regex_storage *mem, const char *str, int len) {
+    if (re->literal != NULL) {
+        int found = substr_search(re->literal, str, (size_t)len);
+        if (found >= 0) {
+            return found;
+        }
+    }
+    if (re->nparts > 0 && !re->engine) {
+        return regex_which(re, mem, str, len) >= 0;
+    }
+    return engine_match(re, mem, str, len);
+}
+
 void regex_free(regex *re) {
     if (re == NULL) {
         return;
     }
+    substr_free(re->literal);
+    ahocorasick_free(re->literals);
+    if (re->engine) {
 #ifdef USE_POSIX_REGEX
+        regfree(&re->re);
 #else
-    pcre_free(re->re);
+        pcre_free_study(re->extra);
+        pcre_free(re->re);
 #endif
+    }
+    for (size_t i = 0; i < re->nparts; ++i) {
+        regex_free(re->parts[i]);
+    }
+    free(re->parts);
     free(re);
     re = NULL;
 }
@@ -99,13 +310,24 @@ regex_storage *regex_storage_new(regex *re) {
     (void)re;
     return NULL;
 #else
+    if (!re->engine && re->nparts == 0) {
+        return NULL;
+    }
     regex_storage *mem = (regex_storage *)malloc(sizeof(regex_storage));
-    const char *error;
-    mem->extra = pcre_study(re->re, PCRE_STUDY_JIT_COMPILE, &error);
-    assert(mem->extra != NULL);
-    mem->jit_stack = pcre_jit_stack_alloc(32 * 1024, 512 * 1024);
-    assert(mem->jit_stack != NULL);
-    pcre_assign_jit_stack(mem->extra, NULL, mem->jit_stack);
+    mem->jit_stack = NULL;
+    if (re->engine) {
+        mem->jit_stack = pcre_jit_stack_alloc(32 * 1024, 512 * 1024);
+        assert(mem->jit_stack != NULL);
+    }
+    mem->parts = NULL;
+    mem->nparts = re->nparts;
+    if (re->nparts > 0) {
+        mem->parts =
+            (regex_storage **)malloc(re->nparts * sizeof(regex_storage *));
+        for (size_t i = 0; i < re->nparts; ++i) {
+            mem->parts[i] = regex_storage_new(re->parts[i]);
+        }
+    }
     return mem;
 #endif
 }
@@ -118,8 +340,13 @@ void regex_storage_free(regex_storage *mem) {
     if (mem == NULL) {
         return;
     }
-    pcre_free_study(mem->extra);
-    pcre_jit_stack_free(mem->jit_stack);
+    if (mem->jit_stack != NULL) {
+        pcre_jit_stack_free(mem->jit_stack);
+    }
+    for (size_t i = 0; i < mem->nparts; ++i) {
+        regex_storage_free(mem->parts[i]);
+    }
+    free(mem->parts);
     free(mem);
     mem = NULL;
 #endif
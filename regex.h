@@ -2,12 +2,19 @@
 
 // C standard library
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef struct _regex regex;
 typedef struct _regex_storage regex_storage;
 
-regex *regex_compile(const char *pattern, bool icase);
+// Room for the message about an invalid pattern
+#define REGEX_ERROR_SIZE 320
+
+regex *regex_compile(const char *const *patterns, size_t n, bool icase);
+regex *regex_try_compile(const char *const *patterns, size_t n, bool icase,
+                         char *error);
 bool regex_match(regex *re, regex_storage *mem, const char *str, int len);
+int regex_which(regex *re, regex_storage *mem, const char *str, int len);
 void regex_free(regex *re);
 
 regex_storage *regex_storage_new(regex *re);